@@ -25,14 +25,20 @@ juno.graphics.init = function(...)
   juno.graphics.fromBlank  = nil
   juno.graphics.fromFile   = nil
   juno.graphics.fromString = nil
-  -- Override juno.graphics.clear() to use _clearColor if available
+  -- Override juno.graphics.clear() to use _clearColor if available, and to
+  -- only clear the areas drawn to last frame if partial clearing is enabled
   local clear = juno.graphics.clear
+  local clearDirty = juno.graphics.clearDirty
   function juno.graphics.clear(r, g, b, a)
     local c = juno.graphics._clearColor
     r = r or (c and c[1])
     g = g or (c and c[2])
     b = b or (c and c[3])
-    clear(r, g, b, 1)
+    if juno.graphics._partialClear then
+      clearDirty(r, g, b, 1)
+    else
+      clear(r, g, b, 1)
+    end
   end
   -- Return main screen buffer
   return screen
@@ -44,3 +50,8 @@ function juno.graphics.setClearColor(...)
 end
 
 
+function juno.graphics.setPartialClear(enabled)
+  juno.graphics._partialClear = enabled
+end
+
+
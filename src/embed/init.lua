@@ -85,6 +85,7 @@ local function onStepMain()
   call(juno.graphics.clear)
   call(juno.onDraw)
   call(juno.debug._draw)
+  call(juno.graphics.flushCommands)
   call(juno.keyboard.reset)
   call(juno.mouse.reset)
 end
@@ -229,14 +230,18 @@ if juno.fs.exists("config.lua") then
 end
 
 local config = merge({
-  title       = "Juno " .. juno.getVersion(),
-  width       = 500,
-  height      = 500,
-  maxfps      = 60,
-  samplerate  = 44100,
-  buffersize  = 2048,
-  fullscreen  = false,
-  resizable   = false,
+  title        = "Juno " .. juno.getVersion(),
+  width        = 500,
+  height       = 500,
+  maxfps       = 60,
+  samplerate   = 44100,
+  buffersize   = 2048,
+  fullscreen   = false,
+  resizable    = false,
+  threads      = 1,
+  deferred     = false,
+  present      = "full",
+  partialclear = false,
 }, c)
 
 if not config.identity then
@@ -262,7 +267,13 @@ juno.fs.mount(path)
 juno.graphics.init(config.width, config.height, config.title,
                    config.fullscreen, config.resizable)
 juno.graphics.setMaxFps(config.maxfps)
+juno.graphics.setThreads(config.threads)
+if config.deferred then
+  juno.graphics.beginCommands()
+end
 juno.graphics.setClearColor(0, 0, 0)
+juno.graphics.setPresentMode(config.present)
+juno.graphics.setPartialClear(config.partialclear)
 juno.audio.init(config.samplerate, config.buffersize)
 
 
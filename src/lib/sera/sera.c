@@ -11,11 +11,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+
+#if defined(__SSE2__) && !defined(SR_NO_SIMD)
+  #include <emmintrin.h>
+  #define USE_SSE2 1
+  #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define USE_AVX2 1
+  #endif
+#endif
 
 #define MIN(a, b)           ((b) < (a) ? (b) : (a))
 #define MAX(a, b)           ((b) > (a) ? (b) : (a))
 #define CLAMP(x, a, b)      (MAX(a, MIN(x, b)))
 #define LERP(bits, a, b, p) ((a) + ((((b) - (a)) * (p)) >> (bits)))
+#define MUL255(a, b)\
+  (((a) * (b) + 0x80 + (((a) * (b) + 0x80) >> 8)) >> 8)
 
 #define SWAP(T, a, b)\
   do {\
@@ -31,13 +43,131 @@
 #define FX_UNIT (1 << FX_BITS)
 #define FX_MASK (FX_UNIT - 1)
 
+#define SPAN_MAX    (256)
+#define ALPHA_MASK  (~SR_RGB_MASK)
+#define ALPHA_SHIFT ((SR_RGB_MASK == 0xffffff) ? 24 : 0)
+
+#define PARALLEL_MIN      (256 * 256)
+#define PARALLEL_MIN_ROWS (16)
+
+#define TILE_SIZE (64)
+
+#define RUN_MIN_USES (2)
+
+#define ROTATION_CACHE_BUDGET (16 << 20)
+
+#define PIXELS_ALIGN (64)
+#define POOL_SLOTS   (32)
+#define POOL_BUDGET  (8 << 20)
+
+/* Views share the pixels of their parent */
+#define ROOT(b)           ((b)->parent ? (b)->parent : (b))
+#define SAME_PIXELS(a, b) ((a) && ROOT(a) == ROOT(b))
+
+/* A view's own flags are copied from its parent when it is made, so its
+ * pixel format is read from the parent which may have changed since */
+#define IS_PREMUL(b)      (ROOT(b)->flags & SR_BUFFER_PREMUL)
+
+/* 8-bit buffers keep their pixels in `data` rather than `pixels` */
+#define IS_8BIT(b)        ((b)->flags & (SR_BUFFER_A8 | SR_BUFFER_INDEXED))
+
+/* A wrapping buffer's pixels are only out of place once it has scrolled */
+#define IS_WRAPPED(b)\
+  (((b)->flags & SR_BUFFER_WRAP) && ((b)->ox || (b)->oy))
+
 
 typedef struct { int x, y; } sr_Point;
 typedef struct { unsigned x, y, z, w; } sr_RandState;
 
+typedef void (*BlendFunc)(sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n);
+typedef void (*SampleFunc)(sr_Pixel *d, sr_Buffer *src, sr_Rect *s,
+                           int sx, int sy, int sxi, int syi, int n);
+
+enum { CMD_CLEAR, CMD_RECT, CMD_COPY, CMD_BUFFER };
+
+typedef struct {
+  int type;
+  sr_Pixel color;
+  sr_Buffer *src;
+  sr_Rect rect;
+  int x, y;
+  sr_Transform t;
+} Command;
+
+typedef struct {
+  Command cmd;
+  sr_DrawMode mode;
+  sr_Rect clip;
+  sr_Rect bounds;
+} Record;
+
+/* Each run is stored as its end column (exclusive) and its type */
+#define RUN_END(r)  ((r) >> 2)
+#define RUN_TYPE(r) ((r) & 3)
+
+enum { RUN_CLEAR, RUN_OPAQUE, RUN_BLEND };
+
+struct sr_RunIndex {
+  int valid;
+  int uses;
+  int *rows;
+  int *runs;
+  int capacity;
+};
+
+typedef struct RotationEntry RotationEntry;
+
+struct RotationEntry {
+  sr_Buffer *src, *buffer;
+  sr_Rect rect;
+  float sx, sy, ox, oy;
+  int filter;
+  int cx, cy;
+  RotationEntry *link;
+  RotationEntry *prev, *next;
+};
+
+struct sr_RotationCache {
+  int steps;
+  RotationEntry **bins;
+};
+
+struct sr_CommandList {
+  sr_Buffer *buffer;
+  Record *records;
+  int count, capacity;
+  int *tiles, tileCapacity;
+  int *bins, binCapacity;
+  sr_CommandList *next;
+};
+
 
 static int inited = 0;
 static unsigned char div8Table[256][256];
+static BlendFunc (*simdSpans)[2];
+static BlendFunc *simdPremulSpans;
+static SampleFunc sampleLinearFunc;
+
+static sr_ParallelFunc parallelFunc;
+static int parallelBands;
+static sr_CommandList *recording;
+static RotationEntry *rotationsHead, *rotationsTail;
+static int rotationsUsed;
+static int rotationsBudget = ROTATION_CACHE_BUDGET;
+static int padRows;
+static int useSimd = 1;
+static struct { void *pixels; int size; } pool[POOL_SLOTS];
+static int poolCount, poolUsed;
+
+static void initBlendFuncs(void);
+static void dispatch(sr_Buffer *b, Command *c);
+static void sync(sr_Buffer *b);
+static void flushAll(void);
+static void clearRotations(sr_Buffer *b);
+static void freeMipmaps(sr_Buffer *b);
+static void execute(sr_Buffer *b, Command *c, sr_Rect *r);
+static void dispatchSource(sr_Buffer *b, Command *c);
+static void prepareWrite(sr_Buffer *b, sr_Rect r);
 
 static void init(void) {
   int a, b;
@@ -48,6 +178,8 @@ static void init(void) {
       div8Table[a][b] = (a << 8) / b;
     }
   }
+  /* Init span blend functions for this cpu */
+  initBlendFuncs();
   /* Inited */
   inited = 1;
 }
@@ -120,6 +252,114 @@ sr_Rect sr_rect(int x, int y, int w, int h) {
 }
 
 
+sr_Pixel sr_premultiply(sr_Pixel c) {
+  c.rgba.r = MUL255(c.rgba.r, c.rgba.a);
+  c.rgba.g = MUL255(c.rgba.g, c.rgba.a);
+  c.rgba.b = MUL255(c.rgba.b, c.rgba.a);
+  return c;
+}
+
+
+sr_Pixel sr_unpremultiply(sr_Pixel c) {
+  int a = c.rgba.a;
+  if (a == 0) {
+    c.word = 0;
+  } else if (a < 0xff) {
+    c.rgba.r = MIN((c.rgba.r * 0xff + (a >> 1)) / a, 0xff);
+    c.rgba.g = MIN((c.rgba.g * 0xff + (a >> 1)) / a, 0xff);
+    c.rgba.b = MIN((c.rgba.b * 0xff + (a >> 1)) / a, 0xff);
+  }
+  return c;
+}
+
+
+static void premultiplyPixels(sr_Pixel *p, int n) {
+  while (n--) {
+    *p = sr_premultiply(*p);
+    p++;
+  }
+}
+
+
+static void unpremultiplyPixels(sr_Pixel *p, int n) {
+  while (n--) {
+    *p = sr_unpremultiply(*p);
+    p++;
+  }
+}
+
+
+/* Converts pixels copied from `src` to the premultiplied-ness of `b` */
+static void convertPixels(sr_Buffer *b, sr_Buffer *src, sr_Pixel *p, int n) {
+  int from = IS_PREMUL(src);
+  int to = IS_PREMUL(b);
+  if (to && !from) premultiplyPixels(p, n);
+  if (from && !to) unpremultiplyPixels(p, n);
+}
+
+
+/* Expands `n` pixels of the 8-bit buffer `b` from x, y to 32-bit pixels; an
+ * indexed pixel is looked up in the buffer's palette, an A8 pixel is white
+ * with the pixel's coverage as its alpha, so that it draws as the current
+ * color times coverage */
+static void expandPixels(sr_Buffer *b, sr_Pixel *d, int x, int y, int n) {
+  unsigned char *s = b->data + x + y * b->stride;
+  sr_Pixel p = sr_pixel(0xff, 0xff, 0xff, 0);
+  if (b->flags & SR_BUFFER_INDEXED) {
+    sr_Pixel *pal = b->palette->colors;
+    while (n--) {
+      *d++ = pal[*s++];
+    }
+    return;
+  }
+  while (n--) {
+    p.rgba.a = *s++;
+    *d++ = p;
+  }
+}
+
+
+/* Copies `n` pixels of `b` from x, y as 32-bit pixels, reading a wrapping
+ * buffer's pixels from where they are stored */
+static void readPixels(sr_Buffer *b, sr_Pixel *d, int x, int y, int n) {
+  int k;
+  if (b->flags & SR_BUFFER_WRAP) {
+    x = (x + b->ox) % b->w;
+    y = (y + b->oy) % b->h;
+  }
+  while (n > 0) {
+    k = MIN(n, b->w - x);
+    if (IS_8BIT(b)) {
+      expandPixels(b, d, x, y, k);
+    } else {
+      memcpy(d, b->pixels + x + y * b->stride, k * sizeof(*d));
+    }
+    d += k;
+    n -= k;
+    x = 0;
+  }
+}
+
+
+/* Inits `tmp` as a 32-bit copy of the rect `s` of the 8-bit or wrapped
+ * buffer `src`, with its pixels in place. This doesn't touch the pixel pool
+ * so it can be done while drawing on several threads; the copy's pixels are
+ * released with free() */
+static int expandBuffer(sr_Buffer *tmp, sr_Buffer *src, sr_Rect s) {
+  int y;
+  memset(tmp, 0, sizeof(*tmp));
+  tmp->pixels = malloc(s.w * s.h * sizeof(*tmp->pixels));
+  if (!tmp->pixels) return 0;
+  tmp->w = tmp->stride = s.w;
+  tmp->h = s.h;
+  tmp->flags = IS_PREMUL(src);
+  for (y = 0; y < s.h; y++) {
+    readPixels(src, tmp->pixels + y * s.w, s.x, s.y + y, s.w);
+  }
+  return 1;
+}
+
+
 static void clipRect(sr_Rect *r, sr_Rect *to) {
   int x1 = MAX(r->x, to->x);
   int y1 = MAX(r->y, to->y);
@@ -148,21 +388,169 @@ static void initBuffer(sr_Buffer *b, void *pixels, int w, int h) {
   b->pixels = pixels;
   b->w = w;
   b->h = h;
+  b->stride = w;
   sr_reset(b);
 }
 
 
+/* Pixels are allocated aligned to PIXELS_ALIGN bytes, the pointer to the
+ * block they were allocated in being stored just before them. Freed pixels
+ * are kept in a small pool, up to POOL_BUDGET bytes, so that buffers of the
+ * same size created again don't go through the system allocator */
+
+static void *allocPixels(int size) {
+  char *block, *p;
+  int i;
+  for (i = poolCount - 1; i >= 0; i--) {
+    if (pool[i].size == size) {
+      p = pool[i].pixels;
+      poolUsed -= size;
+      pool[i] = pool[--poolCount];
+      return p;
+    }
+  }
+  block = malloc(size + PIXELS_ALIGN + sizeof(void*));
+  if (!block) return NULL;
+  p = (char*) (((size_t) block + sizeof(void*) + PIXELS_ALIGN - 1) &
+               ~(size_t) (PIXELS_ALIGN - 1));
+  ((void**) p)[-1] = block;
+  return p;
+}
+
+
+static void freePixels(void *p, int size) {
+  if (size <= POOL_BUDGET) {
+    /* Make room by dropping the oldest pixels in the pool */
+    while (poolCount == POOL_SLOTS || poolUsed + size > POOL_BUDGET) {
+      free(((void**) pool[0].pixels)[-1]);
+      poolUsed -= pool[0].size;
+      memmove(pool, pool + 1, --poolCount * sizeof(*pool));
+    }
+    pool[poolCount].pixels = p;
+    pool[poolCount].size = size;
+    poolCount++;
+    poolUsed += size;
+    return;
+  }
+  free(((void**) p)[-1]);
+}
+
+
+void sr_setRowPadding(int enable) {
+  padRows = enable;
+}
+
+
+/* The SIMD spans are used where the cpu has them unless disabled; they draw
+ * the same pixels as the scalar spans */
+void sr_setSimd(int enable) {
+  useSimd = enable;
+  init();
+  initBlendFuncs();
+}
+
+
+/* A clone shares the pixels of the buffer it was cloned from until either is
+ * written to; `shares` then points to the count of buffers sharing them. A
+ * buffer which has had views made of it is never shared, as its views would
+ * be left pointing at the old pixels when it got a copy of its own */
+
+static void releasePixels(sr_Buffer *b) {
+  if (b->shares) {
+    if (--*b->shares > 0) {
+      b->shares = NULL;
+      return;
+    }
+    free(b->shares);
+    b->shares = NULL;
+  }
+  if (b->data) {
+    freePixels(b->data, b->w * b->h);
+  } else if (~b->flags & SR_BUFFER_SHARED) {
+    freePixels(b->pixels, b->stride * b->h * sizeof(*b->pixels));
+  }
+}
+
+
+/* Gives a buffer sharing its pixels a copy of its own, which is done before
+ * anything is written to it */
+static void unshare(sr_Buffer *b) {
+  void *p;
+  int size;
+  if (*b->shares == 1) {
+    free(b->shares);
+    b->shares = NULL;
+    return;
+  }
+  if (b->data) {
+    size = b->w * b->h;
+    p = allocPixels(size);
+    check(p != NULL, "unshare", "could not allocate pixels");
+    memcpy(p, b->data, size);
+    b->data = p;
+  } else {
+    size = b->stride * b->h * sizeof(*b->pixels);
+    p = allocPixels(size);
+    check(p != NULL, "unshare", "could not allocate pixels");
+    memcpy(p, b->pixels, size);
+    b->pixels = p;
+  }
+  (*b->shares)--;
+  b->shares = NULL;
+}
+
+
+/* Converts an 8-bit buffer to a 32-bit buffer in place, which is done
+ * before anything is written to it */
+static void promote(sr_Buffer *b) {
+  sr_Pixel *pixels = allocPixels(b->w * b->h * sizeof(*pixels));
+  int y;
+  check(pixels != NULL, "promote", "could not allocate pixels");
+  for (y = 0; y < b->h; y++) {
+    expandPixels(b, pixels + y * b->w, 0, y, b->w);
+  }
+  releasePixels(b);
+  b->data = NULL;
+  b->pixels = pixels;
+  b->stride = b->w;
+  b->palette = NULL;
+  b->flags &= ~(SR_BUFFER_A8 | SR_BUFFER_INDEXED);
+}
+
+
+/* Readies the rect `r` of an 8-bit buffer for being written to in place,
+ * keeping it 8-bit. An 8-bit buffer is never a view nor has a run index or
+ * mipmaps */
+static void prepareWrite8(sr_Buffer *b, sr_Rect r) {
+  if (b->shares) {
+    unshare(b);
+  }
+  if (b->rotations) {
+    clearRotations(b);
+  }
+  sr_markDirty(b, r);
+}
+
+
 sr_Buffer *sr_newBuffer(int w, int h) {
   sr_Buffer *b = calloc(1, sizeof(*b));
+  int stride;
   if (!b) return NULL;
   check(w > 0, "sr_newBuffer", "expected width of 1 or greater");
   check(h > 0, "sr_newBuffer", "expected height of 1 or greater");
-  b->pixels = malloc(w * h * sizeof(*b->pixels));
+  /* Padded rows all start on a PIXELS_ALIGN boundary */
+  stride = w;
+  if (padRows) {
+    stride = (w * sizeof(sr_Pixel) + PIXELS_ALIGN - 1) / PIXELS_ALIGN *
+             PIXELS_ALIGN / sizeof(sr_Pixel);
+  }
+  b->pixels = allocPixels(stride * h * sizeof(*b->pixels));
   if (!b->pixels) {
     free(b);
     return NULL;
   }
   initBuffer(b, b->pixels, w, h);
+  b->stride = stride;
   return b;
 }
 
@@ -176,30 +564,137 @@ sr_Buffer *sr_newBufferShared(void *pixels, int w, int h) {
 }
 
 
+sr_Buffer *sr_newBufferA8(int w, int h) {
+  sr_Buffer *b = calloc(1, sizeof(*b));
+  if (!b) return NULL;
+  check(w > 0, "sr_newBufferA8", "expected width of 1 or greater");
+  check(h > 0, "sr_newBufferA8", "expected height of 1 or greater");
+  b->data = allocPixels(w * h);
+  if (!b->data) {
+    free(b);
+    return NULL;
+  }
+  initBuffer(b, NULL, w, h);
+  b->flags |= SR_BUFFER_A8;
+  return b;
+}
+
+
+sr_Buffer *sr_newBufferIndexed(int w, int h, sr_Palette *pal) {
+  sr_Buffer *b;
+  check(w > 0, "sr_newBufferIndexed", "expected width of 1 or greater");
+  check(h > 0, "sr_newBufferIndexed", "expected height of 1 or greater");
+  check(pal != NULL, "sr_newBufferIndexed", "expected palette");
+  b = sr_newBufferA8(w, h);
+  if (!b) return NULL;
+  b->flags = (b->flags & ~SR_BUFFER_A8) | SR_BUFFER_INDEXED;
+  b->palette = pal;
+  return b;
+}
+
+
+sr_Buffer *sr_newBufferView(sr_Buffer *parent, sr_Rect r) {
+  sr_Buffer *b;
+  check(r.w > 0 && r.h > 0 && r.x >= 0 && r.y >= 0 &&
+        r.x + r.w <= parent->w && r.y + r.h <= parent->h,
+        "sr_newBufferView", "rectangle out of bounds");
+  /* Views share 32-bit pixels which are the parent's own */
+  if (IS_8BIT(parent)) {
+    promote(parent);
+  } else if (parent->shares) {
+    unshare(parent);
+  }
+  b = calloc(1, sizeof(*b));
+  if (!b) return NULL;
+  initBuffer(b, parent->pixels + r.x + r.y * parent->stride, r.w, r.h);
+  b->stride = parent->stride;
+  b->flags = (parent->flags & ~SR_BUFFER_WRAP) | SR_BUFFER_SHARED;
+  /* A view of a view is made a view of the root buffer */
+  b->parent = parent->parent ? parent->parent : parent;
+  b->parent->flags |= SR_BUFFER_VIEWED;
+  return b;
+}
+
+
 sr_Buffer *sr_cloneBuffer(sr_Buffer *src) {
   sr_Pixel *pixels;
-  sr_Buffer *b = sr_newBuffer(src->w, src->h);
+  unsigned char *data;
+  sr_Buffer *b;
+  int y, stride;
+  sync(src);
+  /* A buffer with pixels of its own shares them with the clone */
+  if (!(src->flags & (SR_BUFFER_SHARED | SR_BUFFER_VIEWED))) {
+    b = malloc(sizeof(*b));
+    if (!b) return NULL;
+    if (!src->shares) {
+      src->shares = malloc(sizeof(*src->shares));
+      if (!src->shares) {
+        free(b);
+        return NULL;
+      }
+      *src->shares = 1;
+    }
+    (*src->shares)++;
+    memcpy(b, src, sizeof(*b));
+    goto done;
+  }
+  if (IS_8BIT(src)) {
+    b = sr_newBufferA8(src->w, src->h);
+  } else {
+    b = sr_newBuffer(src->w, src->h);
+  }
   if (!b) return NULL;
   pixels = b->pixels;
-  memcpy(pixels, src->pixels, b->w * b->h * sizeof(*b->pixels));
+  data = b->data;
+  stride = b->stride;
+  for (y = 0; y < b->h; y++) {
+    if (data) {
+      memcpy(data + y * stride, src->data + y * src->stride, b->w);
+    } else {
+      memcpy(pixels + y * stride, src->pixels + y * src->stride,
+             b->w * sizeof(*b->pixels));
+    }
+  }
   memcpy(b, src, sizeof(*b));
   b->pixels = pixels;
+  b->data = data;
+  b->stride = stride;
+done:
+  b->flags &= ~(SR_BUFFER_SHARED | SR_BUFFER_VIEWED);
+  b->parent = NULL;
+  b->commands = NULL;
+  b->pending = 0;
+  b->dirty = NULL;
+  b->runs = NULL;
+  b->rotations = NULL;
+  b->mipmap = NULL;
   return b;
 }
 
 
 void sr_destroyBuffer(sr_Buffer *b) {
-  if (~b->flags & SR_BUFFER_SHARED) {
-    free(b->pixels);
+  sync(b);
+  sr_endCommands(b);
+  free(b->dirty);
+  if (b->runs) {
+    free(b->runs->rows);
+    free(b->runs->runs);
+    free(b->runs);
   }
+  sr_setRotationCache(b, 0);
+  freeMipmaps(b);
+  releasePixels(b);
   free(b);
 }
 
 
 void sr_loadPixels(sr_Buffer *b, void *src, int fmt) {
   int sr, sg, sb, sa;
-  int i = b->w * b->h;
+  int x, y;
   unsigned *s = src;
+  sr_Pixel *p;
+  sync(b);
+  prepareWrite(b, sr_rect(0, 0, b->w, b->h));
   switch (fmt) {
     case SR_FMT_BGRA : sr = 16, sg =  8, sb =  0, sa = 24; break;
     case SR_FMT_RGBA : sr =  0, sg =  8, sb = 16, sa = 24; break;
@@ -207,24 +702,132 @@ void sr_loadPixels(sr_Buffer *b, void *src, int fmt) {
     case SR_FMT_ABGR : sr = 24, sg = 16, sb =  8, sa =  0; break;
     default: check(0, "sr_loadPixels", "bad fmt");
   }
-  while (i--) {
-    b->pixels[i].rgba.r = (s[i] >> sr) & 0xff;
-    b->pixels[i].rgba.g = (s[i] >> sg) & 0xff;
-    b->pixels[i].rgba.b = (s[i] >> sb) & 0xff;
-    b->pixels[i].rgba.a = (s[i] >> sa) & 0xff;
+  for (y = 0; y < b->h; y++) {
+    p = b->pixels + y * b->stride;
+    for (x = 0; x < b->w; x++, s++) {
+      p[x].rgba.r = (*s >> sr) & 0xff;
+      p[x].rgba.g = (*s >> sg) & 0xff;
+      p[x].rgba.b = (*s >> sb) & 0xff;
+      p[x].rgba.a = (*s >> sa) & 0xff;
+    }
+    if (IS_PREMUL(b)) {
+      premultiplyPixels(p, b->w);
+    }
   }
 }
 
 
 void sr_loadPixels8(sr_Buffer *b, unsigned char *src, sr_Pixel *pal) {
-  int i = b->w * b->h;
-  while (i--) {
-    if (pal) {
-      b->pixels[i] = pal[src[i]];
+  int x, y;
+  sr_Pixel *p;
+  sync(b);
+  /* Indices are loaded into an indexed buffer as they are, as is coverage
+   * into an A8 buffer */
+  if ((b->flags & SR_BUFFER_INDEXED) || (IS_8BIT(b) && !pal)) {
+    prepareWrite8(b, sr_rect(0, 0, b->w, b->h));
+    memcpy(b->data, src, b->w * b->h);
+    return;
+  }
+  prepareWrite(b, sr_rect(0, 0, b->w, b->h));
+  for (y = 0; y < b->h; y++) {
+    p = b->pixels + y * b->stride;
+    for (x = 0; x < b->w; x++, src++) {
+      if (pal) {
+        p[x] = pal[*src];
+      } else {
+        p[x] = sr_pixel(0xff, 0xff, 0xff, *src);
+      }
+    }
+    if (IS_PREMUL(b)) {
+      premultiplyPixels(p, b->w);
+    }
+  }
+}
+
+
+void sr_setPremultiplied(sr_Buffer *b, int enable) {
+  int y;
+  /* A view always has the format of the buffer it shares pixels with */
+  if (b->parent) return;
+  if (!enable == !(b->flags & SR_BUFFER_PREMUL)) return;
+  sync(b);
+  prepareWrite(b, sr_rect(0, 0, b->w, b->h));
+  for (y = 0; y < b->h; y++) {
+    if (enable) {
+      premultiplyPixels(b->pixels + y * b->stride, b->w);
     } else {
-      b->pixels[i] = sr_pixel(0xff, 0xff, 0xff, src[i]);
+      unpremultiplyPixels(b->pixels + y * b->stride, b->w);
+    }
+  }
+  if (enable) {
+    b->flags |= SR_BUFFER_PREMUL;
+  } else {
+    b->flags &= ~SR_BUFFER_PREMUL;
+  }
+}
+
+
+int sr_isPremultiplied(sr_Buffer *b) {
+  return !!IS_PREMUL(b);
+}
+
+
+/* A wrapping buffer keeps its pixels rotated by its origin so that scrolling
+ * it only moves the origin: the pixel at (x, y) is stored at
+ * ((x + ox) % w, (y + oy) % h). Only draws of the buffer honor the origin,
+ * everything else, drawing to it included, works on the stored pixels */
+
+void sr_setWrap(sr_Buffer *b, int enable) {
+  sr_Pixel *tmp;
+  int y, sy;
+  /* A view's pixels are laid out as its parent's are */
+  if (b->parent) return;
+  if (!enable == !(b->flags & SR_BUFFER_WRAP)) return;
+  if (enable) {
+    b->flags |= SR_BUFFER_WRAP;
+    return;
+  }
+  /* Put the pixels back in place */
+  if (b->ox || b->oy) {
+    sync(b);
+    prepareWrite(b, sr_rect(0, 0, b->w, b->h));
+    tmp = malloc(b->w * b->h * sizeof(*tmp));
+    check(tmp != NULL, "sr_setWrap", "could not allocate pixels");
+    for (y = 0; y < b->h; y++) {
+      sy = (y + b->oy) % b->h;
+      memcpy(tmp + y * b->w, b->pixels + b->ox + sy * b->stride,
+             (b->w - b->ox) * sizeof(*tmp));
+      memcpy(tmp + y * b->w + b->w - b->ox, b->pixels + sy * b->stride,
+             b->ox * sizeof(*tmp));
     }
+    for (y = 0; y < b->h; y++) {
+      memcpy(b->pixels + y * b->stride, tmp + y * b->w, b->w * sizeof(*tmp));
+    }
+    free(tmp);
+  }
+  b->flags &= ~SR_BUFFER_WRAP;
+  b->ox = b->oy = 0;
+}
+
+
+void sr_setPalette(sr_Buffer *b, sr_Palette *pal) {
+  check(b->flags & SR_BUFFER_INDEXED, "sr_setPalette",
+        "expected indexed buffer");
+  check(pal != NULL, "sr_setPalette", "expected palette");
+  /* Draws recorded before the swap use the old palette */
+  sync(b);
+  b->palette = pal;
+}
+
+
+void sr_setPaletteColors(sr_Palette *pal, sr_Pixel *colors, int idx, int n) {
+  check(idx >= 0 && n >= 0 && idx + n <= 256, "sr_setPaletteColors",
+        "colors out of range");
+  /* Draws recorded before the change use the old colors */
+  if (pal->pending > 0) {
+    flushAll();
   }
+  memmove(pal->colors + idx, colors, n * sizeof(*colors));
 }
 
 
@@ -243,6 +846,11 @@ void sr_setColor(sr_Buffer *b, sr_Pixel c) {
 }
 
 
+void sr_setFilter(sr_Buffer *b, int filter) {
+  b->mode.filter = filter;
+}
+
+
 void sr_setClip(sr_Buffer *b, sr_Rect r) {
   b->clip = r;
   r = sr_rect(0, 0, b->w, b->h);
@@ -254,57 +862,140 @@ void sr_reset(sr_Buffer *b) {
   sr_setBlend(b, SR_BLEND_ALPHA);
   sr_setAlpha(b, 0xff);
   sr_setColor(b, sr_color(0xff, 0xff, 0xff));
+  sr_setFilter(b, SR_FILTER_NEAREST);
   sr_setClip(b, sr_rect(0, 0, b->w, b->h));
 }
 
 
+void sr_setParallel(sr_ParallelFunc fn, int bands) {
+  parallelFunc = fn;
+  parallelBands = bands;
+}
+
+
+static void clearRegion(sr_Buffer *b, sr_Pixel c, sr_Rect *r) {
+  sr_Pixel *p;
+  int x, y;
+  for (y = r->y; y < r->y + r->h; y++) {
+    p = b->pixels + r->x + y * b->stride;
+    x = r->w;
+    while (x--) {
+      *p++ = c;
+    }
+  }
+}
+
+
+/* An A8 buffer holds only coverage, so clears, pixel sets and alpha blended
+ * rects write the alpha of their color to it in place and it stays 8-bit;
+ * every other write converts it to a 32-bit buffer first. A rect is blended
+ * as the alpha channel of a 32-bit buffer would be; `r` must be inside the
+ * buffer */
+static void fillA8(sr_Buffer *b, sr_Pixel c, sr_Rect r, int blend) {
+  unsigned char *p;
+  int x, y;
+  int alpha = (c.rgba.a * b->mode.alpha) >> 8;
+  prepareWrite8(b, r);
+  if (blend && alpha <= 1) return;
+  for (y = r.y; y < r.y + r.h; y++) {
+    p = b->data + r.x + y * b->stride;
+    if (!blend || alpha >= 254) {
+      memset(p, c.rgba.a, r.w);
+      continue;
+    }
+    for (x = 0; x < r.w; x++, p++) {
+      if (*p < 254) {
+        *p = 0xff - (((0xff - *p) * (0xff - alpha)) >> 8);
+      }
+    }
+  }
+}
+
+
 void sr_clear(sr_Buffer *b, sr_Pixel c) {
-  int i = b->w * b->h;
-  while (i--) {
-    b->pixels[i] = c;
+  Command cmd;
+  if (b->flags & SR_BUFFER_A8) {
+    sync(b);
+    fillA8(b, c, sr_rect(0, 0, b->w, b->h), 0);
+    return;
   }
+  cmd.type = CMD_CLEAR;
+  cmd.color = IS_PREMUL(b) ? sr_premultiply(c) : c;
+  cmd.src = NULL;
+  dispatch(b, &cmd);
 }
 
 
-sr_Pixel sr_getPixel(sr_Buffer *b, int x, int y) {
+static sr_Pixel getPixel(sr_Buffer *b, int x, int y) {
   sr_Pixel p;
   if (x >= 0 && y >= 0 && x < b->w && y < b->h) {
-    return b->pixels[x + y * b->w];
+    if (IS_8BIT(b)) {
+      expandPixels(b, &p, x, y, 1);
+      return p;
+    }
+    return b->pixels[x + y * b->stride];
   }
   p.word = 0;
   return p;
 }
 
 
+sr_Pixel sr_getPixel(sr_Buffer *b, int x, int y) {
+  sync(b);
+  if (IS_PREMUL(b)) {
+    return sr_unpremultiply(getPixel(b, x, y));
+  }
+  return getPixel(b, x, y);
+}
+
+
 void sr_setPixel(sr_Buffer *b, sr_Pixel c, int x, int y) {
+  sync(b);
+  if (b->flags & SR_BUFFER_A8) {
+    prepareWrite8(b, sr_rect(x, y, 1, 1));
+    if (x >= 0 && y >= 0 && x < b->w && y < b->h) {
+      b->data[x + y * b->stride] = c.rgba.a;
+    }
+    return;
+  }
+  prepareWrite(b, sr_rect(x, y, 1, 1));
+  if (IS_PREMUL(b)) {
+    c = sr_premultiply(c);
+  }
   if (x >= 0 && y >= 0 && x < b->w && y < b->h) {
-    b->pixels[x + y * b->w] = c;
+    b->pixels[x + y * b->stride] = c;
   }
 }
 
 
 static void copyPixelsBasic(
-  sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s
+  sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s, sr_Rect *r
 ) {
   int i;
-  /* Clip to destination buffer */
-  clipRectAndOffset(&s, &x, &y, &b->clip);
+  /* Clip to destination region */
+  clipRectAndOffset(&s, &x, &y, r);
   /* Clipped off screen? */
   if (s.w <= 0 || s.h <= 0) return;
   /* Copy pixels */
   for (i = 0; i < s.h; i++) {
-    memcpy(b->pixels + x + (y + i) * b->w,
-           src->pixels + s.x + (s.y + i) * src->w,
-           s.w * sizeof(*b->pixels));
+    if (IS_8BIT(src)) {
+      expandPixels(src, b->pixels + x + (y + i) * b->stride,
+                   s.x, s.y + i, s.w);
+    } else {
+      memcpy(b->pixels + x + (y + i) * b->stride,
+             src->pixels + s.x + (s.y + i) * src->stride,
+             s.w * sizeof(*b->pixels));
+    }
+    convertPixels(b, src, b->pixels + x + (y + i) * b->stride, s.w);
   }
 }
 
 
 static void copyPixelsScaled(
   sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s,
-  float scalex, float scaley
+  float scalex, float scaley, sr_Rect *r
 ) {
-  int d, dx, dy,  edx, sx, sy, inx, iny;
+  int d, dx, dy, edx, sx, sy, inx, iny, dx0, dy0, dx1, dy1;
   sr_Pixel *p;
   int w = s.w * scalex;
   int h = s.h * scaley;
@@ -317,26 +1008,184 @@ static void copyPixelsScaled(
   if ((d = ((y + h) - (b->clip.y + b->clip.h))) > 0) { h -= d; }
   /* Clipped offscreen? */
   if (w == 0 || h == 0) return;
+  /* Restrict to region -- source positions are still stepped from the clipped
+   * origin so that the result does not depend on the region */
+  dx0 = MAX(x, r->x);
+  dy0 = MAX(y, r->y);
+  dx1 = MIN(x + w, r->x + r->w);
+  dy1 = MIN(y + h, r->y + r->h);
   /* Draw */
-  sy = s.y << FX_BITS;
-  for (dy = y; dy < y + h; dy++) {
-    p = src->pixels + (s.x >> FX_BITS) + src->w * (sy >> FX_BITS);
-    sx = 0;
-    dx = x + b->w * dy;
-    edx = dx + w;
+  sy = (s.y << FX_BITS) + (dy0 - y) * iny;
+  for (dy = dy0; dy < dy1; dy++) {
+    p = src->pixels + s.x + src->stride * (sy >> FX_BITS);
+    sx = (dx0 - x) * inx;
+    dx = dx0 + b->stride * dy;
+    edx = dx1 + b->stride * dy;
     while (dx < edx) {
       b->pixels[dx++] = p[sx >> FX_BITS];
       sx += inx;
     }
+    convertPixels(b, src, b->pixels + dx0 + b->stride * dy, dx1 - dx0);
     sy += iny;
   }
 }
 
 
+/* Copies scaled up by a whole number `n`. The source column of each
+ * destination column is worked out once, with the same fixed point steps as
+ * copyPixelsScaled() so the result is the same as its, and each row which
+ * reads the same source row as the one above it is a copy of that row */
+static void copyPixelsInteger(
+  sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s, int n, sr_Rect *r
+) {
+  int d, i, dy, sy, inx, iny, dx0, dy0, dx1, dy1, last = -1;
+  sr_Pixel *pd, *ps;
+  sr_Rect s0 = s;
+  int x0 = x, y0 = y;
+  int *cols;
+  int w = s.w * n;
+  int h = s.h * n;
+  inx = FX_UNIT / n;
+  iny = FX_UNIT / n;
+  /* Clip to destination buffer */
+  if ((d = (b->clip.x - x)) > 0) { x += d; s.x += d / n; w -= d; }
+  if ((d = (b->clip.y - y)) > 0) { y += d; s.y += d / n; h -= d; }
+  if ((d = ((x + w) - (b->clip.x + b->clip.w))) > 0) { w -= d; }
+  if ((d = ((y + h) - (b->clip.y + b->clip.h))) > 0) { h -= d; }
+  /* Restrict to region */
+  dx0 = MAX(x, r->x);
+  dy0 = MAX(y, r->y);
+  dx1 = MIN(x + w, r->x + r->w);
+  dy1 = MIN(y + h, r->y + r->h);
+  if (dx1 <= dx0 || dy1 <= dy0) return;
+  /* This can be run on several threads so doesn't use the pixel pool */
+  cols = malloc((dx1 - dx0) * sizeof(*cols));
+  if (!cols) {
+    copyPixelsScaled(b, src, x0, y0, s0, n, n, r);
+    return;
+  }
+  for (i = 0; i < dx1 - dx0; i++) {
+    cols[i] = s.x + (((dx0 - x + i) * inx) >> FX_BITS);
+  }
+  /* Draw */
+  sy = (s.y << FX_BITS) + (dy0 - y) * iny;
+  for (dy = dy0; dy < dy1; dy++, sy += iny) {
+    pd = b->pixels + dx0 + dy * b->stride;
+    if ((sy >> FX_BITS) == last) {
+      memcpy(pd, pd - b->stride, (dx1 - dx0) * sizeof(*pd));
+      continue;
+    }
+    last = sy >> FX_BITS;
+    ps = src->pixels + last * src->stride;
+    for (i = 0; i < dx1 - dx0; i++) {
+      pd[i] = ps[cols[i]];
+    }
+    convertPixels(b, src, pd, dx1 - dx0);
+  }
+  free(cols);
+}
+
+
+/* Mipmaps are a chain of buffers, each half the size of the last, made by
+ * averaging 2x2 blocks of pixels. A draw scaled down to half size or less
+ * reads from the smallest level whose scale is still at or above the draw's
+ * instead of skipping through the full sized buffer. A buffer's mipmaps are
+ * freed when it is written to */
+
+static void freeMipmaps(sr_Buffer *b) {
+  if (b->mipmap) {
+    sr_destroyBuffer(b->mipmap);
+    b->mipmap = NULL;
+  }
+}
+
+
+static sr_Pixel averagePixels(sr_Pixel *p, int premul) {
+  sr_Pixel res, t[4];
+  int i, convert = 0;
+  memcpy(t, p, sizeof(t));
+  /* Straight pixels are averaged premultiplied so that transparent pixels
+   * don't bleed their color */
+  if (!premul && (~(t[0].word & t[1].word & t[2].word & t[3].word) &
+                  ALPHA_MASK)) {
+    for (i = 0; i < 4; i++) {
+      t[i] = sr_premultiply(t[i]);
+    }
+    convert = 1;
+  }
+  #define X(c)\
+    res.rgba.c = (t[0].rgba.c + t[1].rgba.c + t[2].rgba.c + t[3].rgba.c + 2) >> 2;
+  X(r) X(g) X(b) X(a)
+  #undef X
+  return convert ? sr_unpremultiply(res) : res;
+}
+
+
+void sr_generateMipmaps(sr_Buffer *b) {
+  sr_Buffer *level, *m;
+  sr_Pixel t[4], *s0, *s1;
+  int x, y;
+  /* Views can't tell when their pixels change so don't have mipmaps, and
+   * 8-bit buffers are kept small rather than fast to downscale */
+  if (b->parent || IS_8BIT(b)) return;
+  sync(b);
+  freeMipmaps(b);
+  for (level = b; level->w > 1 || level->h > 1; level = m) {
+    m = sr_newBuffer(MAX(level->w >> 1, 1), MAX(level->h >> 1, 1));
+    if (!m) return;
+    m->flags |= IS_PREMUL(level);
+    for (y = 0; y < m->h; y++) {
+      s0 = level->pixels + (y << 1) * level->stride;
+      s1 = (level->h > 1) ? s0 + level->stride : s0;
+      for (x = 0; x < m->w; x++) {
+        t[0] = s0[x << 1];
+        t[2] = s1[x << 1];
+        t[1] = (level->w > 1) ? s0[(x << 1) + 1] : t[0];
+        t[3] = (level->w > 1) ? s1[(x << 1) + 1] : t[2];
+        m->pixels[x + y * m->stride] = averagePixels(t, IS_PREMUL(m));
+      }
+    }
+    level->mipmap = m;
+  }
+}
+
+
+/* Points a scaled draw or copy at the mipmap level it should read from */
+static void useMipmaps(sr_Buffer *b, Command *c) {
+  sr_Buffer *level = c->src;
+  sr_Rect s = c->rect;
+  float scale = MAX(fabs(c->t.sx), fabs(c->t.sy));
+  int k = 0;
+  int x0, y0, x1, y1;
+  if (SAME_PIXELS(c->src, b)) return;
+  /* Find level */
+  while (scale <= .5 && level->mipmap) {
+    x0 = c->rect.x >> (k + 1);
+    y0 = c->rect.y >> (k + 1);
+    x1 = (c->rect.x + c->rect.w) >> (k + 1);
+    y1 = (c->rect.y + c->rect.h) >> (k + 1);
+    if (x1 - x0 < 1 || y1 - y0 < 1) break;
+    level = level->mipmap;
+    s = sr_rect(x0, y0, x1 - x0, y1 - y0);
+    scale *= 2;
+    k++;
+  }
+  if (k == 0) return;
+  /* Adjust the transform so the draw covers the same area */
+  c->t.sx *= (float) c->rect.w / s.w;
+  c->t.sy *= (float) c->rect.h / s.h;
+  c->t.ox *= (float) s.w / c->rect.w;
+  c->t.oy *= (float) s.h / c->rect.h;
+  c->src = level;
+  c->rect = s;
+}
+
+
 void sr_copyPixels(
   sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect *sub,
   float sx, float sy
 ) {
+  Command cmd;
   sr_Rect s;
   sx = fabs(sx);
   sy = fabs(sy);
@@ -351,198 +1200,1097 @@ void sr_copyPixels(
     s = sr_rect(0, 0, src->w, src->h);
   }
   /* Dispatch */
-  if (sx == 1 && sy == 1) {
-    /* Basic un-scaled copy */
-    copyPixelsBasic(b, src, x, y, s);
+  cmd.type = CMD_COPY;
+  cmd.src = src;
+  cmd.rect = s;
+  cmd.x = x;
+  cmd.y = y;
+  cmd.t = sr_transform();
+  cmd.t.sx = sx;
+  cmd.t.sy = sy;
+  dispatchSource(b, &cmd);
+}
+
+
+/* Moves the content of the buffer by `dx`, `dy`. The strips this leaves
+ * uncovered keep their old pixels, and are expected to be drawn over.
+ * Scrolling a wrapping buffer only moves its origin */
+void sr_scroll(sr_Buffer *b, int dx, int dy) {
+  sr_Pixel *p;
+  int y, w, h, x0, x1, y0, y1;
+  if (dx == 0 && dy == 0) return;
+  if (b->flags & SR_BUFFER_WRAP) {
+    /* Recorded draws of the buffer read it through its current origin */
+    sync(b);
+    b->ox = ((b->ox - dx) % b->w + b->w) % b->w;
+    b->oy = ((b->oy - dy) % b->h + b->h) % b->h;
+    return;
+  }
+  sync(b);
+  prepareWrite(b, sr_rect(0, 0, b->w, b->h));
+  w = b->w - abs(dx);
+  h = b->h - abs(dy);
+  if (w <= 0 || h <= 0) return;
+  x0 = MAX(-dx, 0);
+  x1 = MAX(dx, 0);
+  y0 = MAX(-dy, 0);
+  y1 = MAX(dy, 0);
+  p = b->pixels;
+  /* Rows are moved starting with the one furthest in the direction of the
+   * move so none is overwritten before it is read */
+  if (dy > 0) {
+    for (y = h - 1; y >= 0; y--) {
+      memmove(p + x1 + (y1 + y) * b->stride, p + x0 + (y0 + y) * b->stride,
+              w * sizeof(*p));
+    }
   } else {
-    /* Scaled copy */
-    copyPixelsScaled(b, src, x, y, s, sx, sy);
+    for (y = 0; y < h; y++) {
+      memmove(p + x1 + (y1 + y) * b->stride, p + x0 + (y0 + y) * b->stride,
+              w * sizeof(*p));
+    }
   }
 }
 
 
 void sr_noise(sr_Buffer *b, unsigned seed, int low, int high, int grey) {
   sr_RandState s = rand128init(seed);
-  int i;
+  sr_Pixel *p;
+  int x, y;
+  sync(b);
+  prepareWrite(b, sr_rect(0, 0, b->w, b->h));
   low = CLAMP(low, 0, 0xfe);
   high = CLAMP(high, low + 1, 0xff);
-  i = b->w * b->h;
-  if (grey) {
-    while (i--) {
-      b->pixels[i].rgba.r = low + rand128(&s) % (high - low);
-      b->pixels[i].rgba.g = b->pixels[i].rgba.b = b->pixels[i].rgba.r;
-      b->pixels[i].rgba.a = 0xff;
-    }
-  } else {
-    while (i--) {
-      b->pixels[i].word = rand128(&s) | ~SR_RGB_MASK;
-      b->pixels[i].rgba.r = low + b->pixels[i].rgba.r % (high - low);
-      b->pixels[i].rgba.g = low + b->pixels[i].rgba.g % (high - low);
-      b->pixels[i].rgba.b = low + b->pixels[i].rgba.b % (high - low);
+  for (y = b->h - 1; y >= 0; y--) {
+    for (x = b->w - 1; x >= 0; x--) {
+      p = b->pixels + x + y * b->stride;
+      if (grey) {
+        p->rgba.r = low + rand128(&s) % (high - low);
+        p->rgba.g = p->rgba.b = p->rgba.r;
+        p->rgba.a = 0xff;
+      } else {
+        p->word = rand128(&s) | ~SR_RGB_MASK;
+        p->rgba.r = low + p->rgba.r % (high - low);
+        p->rgba.g = low + p->rgba.g % (high - low);
+        p->rgba.b = low + p->rgba.b % (high - low);
+      }
     }
   }
 }
 
 
-static void floodFill(sr_Buffer *b, sr_Pixel c, sr_Pixel o, int x, int y) {
-  int ir, il;
-  if (
-    y < 0 || y >= b->h || x < 0 || x >= b->w ||
-    b->pixels[x + y * b->w].word != o.word
-  ) {
-    return;
-  }
-  /* Fill left */
-  il = x;
-  while (il >= 0 && b->pixels[il + y * b->w].word == o.word) {
-    b->pixels[il + y * b->w] = c;
-    il--;
-  }
-  /* Fill right */
-  ir = (x < b->w - 1) ? (x + 1) : x;
-  while (ir < b->w && b->pixels[ir + y * b->w].word == o.word) {
-    b->pixels[ir + y * b->w] = c;
-    ir++;
-  }
-  /* Fill up and down */
-  while (il <= ir) {
-    floodFill(b, c, o, il, y - 1);
-    floodFill(b, c, o, il, y + 1);
-    il++;
-  }
+/* Flood fill is a scanline fill driven by a stack of spans. Each span is a
+ * range of a line `y - dy` which has been filled; line `y` is scanned
+ * under it for runs to fill, which are pushed to continue in the same
+ * direction, and any part of a run sticking out past the span is pushed back
+ * the other way. When the fill color would itself be filled again, which can
+ * happen with a tolerance, a bit per pixel marks the filled pixels */
+
+typedef struct { int y, x1, x2, dy; } FillSpan;
+
+typedef struct {
+  sr_Buffer *b;
+  sr_Pixel c, o;
+  int tolerance;
+  unsigned char *mask;
+  FillSpan *spans;
+  int count, capacity;
+  int failed;
+} Fill;
+
+
+static int matchesFill(Fill *f, sr_Pixel p) {
+  if (p.word == f->o.word) return 1;
+  if (f->tolerance == 0) return 0;
+  return abs(p.rgba.r - f->o.rgba.r) <= f->tolerance &&
+         abs(p.rgba.g - f->o.rgba.g) <= f->tolerance &&
+         abs(p.rgba.b - f->o.rgba.b) <= f->tolerance &&
+         abs(p.rgba.a - f->o.rgba.a) <= f->tolerance;
 }
 
 
-void sr_floodFill(sr_Buffer *b, sr_Pixel c, int x, int y) {
-  floodFill(b, c, sr_getPixel(b, x, y), x, y);
+static int isFillable(Fill *f, int x, int y) {
+  int i = x + y * f->b->w;
+  if (f->mask && (f->mask[i >> 3] & (1 << (i & 7)))) return 0;
+  return matchesFill(f, f->b->pixels[x + y * f->b->stride]);
 }
 
 
-static void blendPixel(sr_DrawMode *m, sr_Pixel *d, sr_Pixel s) {
-  int alpha = (s.rgba.a * m->alpha) >> 8;
-  if (alpha <= 1) return;
-  /* Color */
-  if (m->color.word != SR_RGB_MASK) {
-    s.rgba.r = (s.rgba.r * m->color.rgba.r) >> 8;
-    s.rgba.g = (s.rgba.g * m->color.rgba.g) >> 8;
-    s.rgba.b = (s.rgba.b * m->color.rgba.b) >> 8;
+static void fillRun(Fill *f, int x1, int x2, int y) {
+  sr_Pixel *p = f->b->pixels + y * f->b->stride;
+  int i;
+  for (i = x1 + y * f->b->w; x1 <= x2; x1++, i++) {
+    p[x1] = f->c;
+    if (f->mask) f->mask[i >> 3] |= 1 << (i & 7);
   }
-  /* Blend */
-  switch (m->blend) {
-    default:
-    case SR_BLEND_ALPHA:
-      break;
-    case SR_BLEND_COLOR:
-      s = m->color;
-      break;
-    case SR_BLEND_ADD:
-      s.rgba.r = MIN(d->rgba.r + s.rgba.r, 0xff);
-      s.rgba.g = MIN(d->rgba.g + s.rgba.g, 0xff);
-      s.rgba.b = MIN(d->rgba.b + s.rgba.b, 0xff);
-      break;
-    case SR_BLEND_SUBTRACT:
-      s.rgba.r = MIN(d->rgba.r - s.rgba.r, 0);
-      s.rgba.g = MIN(d->rgba.g - s.rgba.g, 0);
-      s.rgba.b = MIN(d->rgba.b - s.rgba.b, 0);
-      break;
-    case SR_BLEND_MULTIPLY:
-      s.rgba.r = (s.rgba.r * d->rgba.r) >> 8;
-      s.rgba.g = (s.rgba.g * d->rgba.g) >> 8;
-      s.rgba.b = (s.rgba.b * d->rgba.b) >> 8;
-      break;
-    case SR_BLEND_LIGHTEN:
-      s = (s.rgba.r + s.rgba.g + s.rgba.b >
-           d->rgba.r + d->rgba.g + d->rgba.b) ? s : *d;
-      break;
-    case SR_BLEND_DARKEN:
-      s = (s.rgba.r + s.rgba.g + s.rgba.b <
-           d->rgba.r + d->rgba.g + d->rgba.b) ? s : *d;
-      break;
-    case SR_BLEND_SCREEN:
-      s.rgba.r = 0xff - (((0xff - d->rgba.r) * (0xff - s.rgba.r)) >> 8);
-      s.rgba.g = 0xff - (((0xff - d->rgba.g) * (0xff - s.rgba.g)) >> 8);
-      s.rgba.b = 0xff - (((0xff - d->rgba.b) * (0xff - s.rgba.b)) >> 8);
-      break;
-    case SR_BLEND_DIFFERENCE:
-      s.rgba.r = abs(s.rgba.r - d->rgba.r);
-      s.rgba.g = abs(s.rgba.g - d->rgba.g);
-      s.rgba.b = abs(s.rgba.b - d->rgba.b);
-      break;
+}
+
+
+static void pushFillSpan(Fill *f, int y, int x1, int x2, int dy) {
+  FillSpan *s;
+  if (y < 0 || y >= f->b->h) return;
+  if (f->count == f->capacity) {
+    int n = f->capacity ? f->capacity << 1 : 256;
+    s = realloc(f->spans, n * sizeof(*s));
+    if (!s) {
+      f->failed = 1;
+      return;
+    }
+    f->spans = s;
+    f->capacity = n;
   }
-  /* Write */
-  if (alpha >= 254) {
-    *d = s;
-  } else if (d->rgba.a >= 254) {
-    d->rgba.r = LERP(8, d->rgba.r, s.rgba.r, alpha);
-    d->rgba.g = LERP(8, d->rgba.g, s.rgba.g, alpha);
-    d->rgba.b = LERP(8, d->rgba.b, s.rgba.b, alpha);
-  } else {
-    int a = 0xff - (((0xff - d->rgba.a) * (0xff - alpha)) >> 8);
-    int z = (d->rgba.a * (0xff - alpha)) >> 8;
-    d->rgba.r = div8Table[((d->rgba.r * z) >>8) + ((s.rgba.r * alpha) >>8)][a];
-    d->rgba.g = div8Table[((d->rgba.g * z) >>8) + ((s.rgba.g * alpha) >>8)][a];
-    d->rgba.b = div8Table[((d->rgba.b * z) >>8) + ((s.rgba.b * alpha) >>8)][a];
-    d->rgba.a = a;
+  s = &f->spans[f->count++];
+  s->y = y;
+  s->x1 = x1;
+  s->x2 = x2;
+  s->dy = dy;
+}
+
+
+/* Fills the area around x, y which matches its pixel within `tolerance`.
+ * The area is 4-connected, or also reaches diagonally if `diagonal` is
+ * set. Returns 0 if the span stack couldn't be allocated, in which case the
+ * area may be left partly filled */
+int sr_floodFill(
+  sr_Buffer *b, sr_Pixel c, int x, int y, int tolerance, int diagonal
+) {
+  Fill f;
+  FillSpan s;
+  int l, r, lo, hi;
+  sync(b);
+  if (x < 0 || y < 0 || x >= b->w || y >= b->h) return 1;
+  prepareWrite(b, sr_rect(0, 0, b->w, b->h));
+  if (IS_PREMUL(b)) {
+    c = sr_premultiply(c);
+  }
+  diagonal = !!diagonal;
+  f.b = b;
+  f.c = c;
+  f.o = getPixel(b, x, y);
+  f.tolerance = CLAMP(tolerance, 0, 0xff);
+  f.mask = NULL;
+  f.spans = NULL;
+  f.count = f.capacity = 0;
+  f.failed = 0;
+  if (matchesFill(&f, c)) {
+    if (f.tolerance == 0) return 1;
+    f.mask = calloc((b->w * b->h + 7) >> 3, 1);
+    if (!f.mask) return 0;
   }
+  /* Fill the seed's run and scan out from it both ways */
+  l = r = x;
+  while (l > 0 && isFillable(&f, l - 1, y)) l--;
+  while (r < b->w - 1 && isFillable(&f, r + 1, y)) r++;
+  fillRun(&f, l, r, y);
+  pushFillSpan(&f, y + 1, l, r, 1);
+  pushFillSpan(&f, y - 1, l, r, -1);
+  while (f.count > 0 && !f.failed) {
+    s = f.spans[--f.count];
+    /* An 8-connected fill also reaches the pixels diagonal to the span */
+    lo = MAX(s.x1 - diagonal, 0);
+    hi = MIN(s.x2 + diagonal, b->w - 1);
+    x = lo;
+    while (x <= hi) {
+      if (!isFillable(&f, x, s.y)) {
+        x++;
+        continue;
+      }
+      l = r = x;
+      if (x == lo) {
+        while (l > 0 && isFillable(&f, l - 1, s.y)) l--;
+      }
+      while (r < b->w - 1 && isFillable(&f, r + 1, s.y)) r++;
+      fillRun(&f, l, r, s.y);
+      pushFillSpan(&f, s.y + s.dy, l, r, s.dy);
+      if (l < s.x1) pushFillSpan(&f, s.y - s.dy, l, s.x1 - 1, -s.dy);
+      if (r > s.x2) pushFillSpan(&f, s.y - s.dy, s.x2 + 1, r, -s.dy);
+      x = r + 2;
+    }
+  }
+  free(f.spans);
+  free(f.mask);
+  return !f.failed;
 }
 
 
-void sr_drawPixel(sr_Buffer *b, sr_Pixel c, int x, int y) {
+/* Each blend span below is generated from the BLEND_SPAN() template for every
+ * combination of blend mode, color tint on/off, full/partial alpha and
+ * opaque/unknown destination so that the per-pixel loop carries no branches
+ * which could instead be decided once per draw call */
+
+#define BLEND_ALPHA(s, d)
+
+#define BLEND_COLOR(s, d)\
+  s = m->color
+
+#define BLEND_ADD(s, d)\
+  s.rgba.r = MIN(d->rgba.r + s.rgba.r, 0xff);\
+  s.rgba.g = MIN(d->rgba.g + s.rgba.g, 0xff);\
+  s.rgba.b = MIN(d->rgba.b + s.rgba.b, 0xff)
+
+#define BLEND_SUBTRACT(s, d)\
+  s.rgba.r = MIN(d->rgba.r - s.rgba.r, 0);\
+  s.rgba.g = MIN(d->rgba.g - s.rgba.g, 0);\
+  s.rgba.b = MIN(d->rgba.b - s.rgba.b, 0)
+
+#define BLEND_MULTIPLY(s, d)\
+  s.rgba.r = (s.rgba.r * d->rgba.r) >> 8;\
+  s.rgba.g = (s.rgba.g * d->rgba.g) >> 8;\
+  s.rgba.b = (s.rgba.b * d->rgba.b) >> 8
+
+#define BLEND_LIGHTEN(s, d)\
+  s = (s.rgba.r + s.rgba.g + s.rgba.b >\
+       d->rgba.r + d->rgba.g + d->rgba.b) ? s : *d
+
+#define BLEND_DARKEN(s, d)\
+  s = (s.rgba.r + s.rgba.g + s.rgba.b <\
+       d->rgba.r + d->rgba.g + d->rgba.b) ? s : *d
+
+#define BLEND_SCREEN(s, d)\
+  s.rgba.r = 0xff - (((0xff - d->rgba.r) * (0xff - s.rgba.r)) >> 8);\
+  s.rgba.g = 0xff - (((0xff - d->rgba.g) * (0xff - s.rgba.g)) >> 8);\
+  s.rgba.b = 0xff - (((0xff - d->rgba.b) * (0xff - s.rgba.b)) >> 8)
+
+#define BLEND_DIFFERENCE(s, d)\
+  s.rgba.r = abs(s.rgba.r - d->rgba.r);\
+  s.rgba.g = abs(s.rgba.g - d->rgba.g);\
+  s.rgba.b = abs(s.rgba.b - d->rgba.b)
+
+#define BLEND_SPAN(NAME, BLEND, TINT, FULL, OPAQUE)\
+  static void NAME(sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n) {\
+    sr_Pixel p;\
+    int alpha;\
+    for (; n--; d++, s++) {\
+      p = *s;\
+      alpha = (p.rgba.a * (FULL ? 0xff : m->alpha)) >> 8;\
+      if (alpha <= 1) continue;\
+      /* Color */\
+      if (TINT) {\
+        p.rgba.r = (p.rgba.r * m->color.rgba.r) >> 8;\
+        p.rgba.g = (p.rgba.g * m->color.rgba.g) >> 8;\
+        p.rgba.b = (p.rgba.b * m->color.rgba.b) >> 8;\
+      }\
+      /* Blend */\
+      BLEND_##BLEND(p, d);\
+      /* Write */\
+      if (alpha >= 254) {\
+        *d = p;\
+      } else if (OPAQUE || d->rgba.a >= 254) {\
+        d->rgba.r = LERP(8, d->rgba.r, p.rgba.r, alpha);\
+        d->rgba.g = LERP(8, d->rgba.g, p.rgba.g, alpha);\
+        d->rgba.b = LERP(8, d->rgba.b, p.rgba.b, alpha);\
+      } else {\
+        int a = 0xff - (((0xff - d->rgba.a) * (0xff - alpha)) >> 8);\
+        int z = (d->rgba.a * (0xff - alpha)) >> 8;\
+        d->rgba.r = div8Table[((d->rgba.r * z) >> 8) +\
+                              ((p.rgba.r * alpha) >> 8)][a];\
+        d->rgba.g = div8Table[((d->rgba.g * z) >> 8) +\
+                              ((p.rgba.g * alpha) >> 8)][a];\
+        d->rgba.b = div8Table[((d->rgba.b * z) >> 8) +\
+                              ((p.rgba.b * alpha) >> 8)][a];\
+        d->rgba.a = a;\
+      }\
+    }\
+  }
+
+/* Index into a mode's table of spans */
+#define SPAN_TINT   (1 << 2)
+#define SPAN_FULL   (1 << 1)
+#define SPAN_OPAQUE (1 << 0)
+
+#define BLEND_SPANS(NAME, BLEND)\
+  BLEND_SPAN(NAME##000, BLEND, 0, 0, 0)\
+  BLEND_SPAN(NAME##001, BLEND, 0, 0, 1)\
+  BLEND_SPAN(NAME##010, BLEND, 0, 1, 0)\
+  BLEND_SPAN(NAME##011, BLEND, 0, 1, 1)\
+  BLEND_SPAN(NAME##100, BLEND, 1, 0, 0)\
+  BLEND_SPAN(NAME##101, BLEND, 1, 0, 1)\
+  BLEND_SPAN(NAME##110, BLEND, 1, 1, 0)\
+  BLEND_SPAN(NAME##111, BLEND, 1, 1, 1)
+
+#define BLEND_SPANS_ENTRY(NAME)\
+  { NAME##000, NAME##001, NAME##010, NAME##011,\
+    NAME##100, NAME##101, NAME##110, NAME##111 }
+
+BLEND_SPANS(blendSpanAlpha,      ALPHA)
+BLEND_SPANS(blendSpanColor,      COLOR)
+BLEND_SPANS(blendSpanAdd,        ADD)
+BLEND_SPANS(blendSpanSubtract,   SUBTRACT)
+BLEND_SPANS(blendSpanMultiply,   MULTIPLY)
+BLEND_SPANS(blendSpanLighten,    LIGHTEN)
+BLEND_SPANS(blendSpanDarken,     DARKEN)
+BLEND_SPANS(blendSpanScreen,     SCREEN)
+BLEND_SPANS(blendSpanDifference, DIFFERENCE)
+
+static BlendFunc blendSpans[SR_BLEND_DIFFERENCE + 1][8] = {
+  BLEND_SPANS_ENTRY(blendSpanAlpha),
+  BLEND_SPANS_ENTRY(blendSpanColor),
+  BLEND_SPANS_ENTRY(blendSpanAdd),
+  BLEND_SPANS_ENTRY(blendSpanSubtract),
+  BLEND_SPANS_ENTRY(blendSpanMultiply),
+  BLEND_SPANS_ENTRY(blendSpanLighten),
+  BLEND_SPANS_ENTRY(blendSpanDarken),
+  BLEND_SPANS_ENTRY(blendSpanScreen),
+  BLEND_SPANS_ENTRY(blendSpanDifference),
+};
+
+
+static int getSpanIndex(sr_DrawMode *m, int opaque) {
+  return (m->color.word != SR_RGB_MASK ? SPAN_TINT : 0) |
+         (m->alpha == 0xff ? SPAN_FULL : 0) |
+         (opaque ? SPAN_OPAQUE : 0);
+}
+
+
+/* Alpha blending onto a premultiplied destination is a plain "source over"
+ * on all four channels and needs no division. The source is premultiplied
+ * first if it isn't already (PREMUL == 0); these spans are indexed by
+ * getSpanIndex() with the source's premultiplied-ness in place of OPAQUE */
+
+#define PREMUL_SPAN(NAME, TINT, FULL, PREMUL)\
+  static void NAME(sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n) {\
+    sr_Pixel p;\
+    int ia;\
+    for (; n--; d++, s++) {\
+      p = *s;\
+      if (!PREMUL) {\
+        p = sr_premultiply(p);\
+      }\
+      /* Color */\
+      if (TINT) {\
+        p.rgba.r = MUL255(p.rgba.r, m->color.rgba.r);\
+        p.rgba.g = MUL255(p.rgba.g, m->color.rgba.g);\
+        p.rgba.b = MUL255(p.rgba.b, m->color.rgba.b);\
+      }\
+      /* Alpha */\
+      if (!FULL) {\
+        p.rgba.r = MUL255(p.rgba.r, m->alpha);\
+        p.rgba.g = MUL255(p.rgba.g, m->alpha);\
+        p.rgba.b = MUL255(p.rgba.b, m->alpha);\
+        p.rgba.a = MUL255(p.rgba.a, m->alpha);\
+      }\
+      /* Write */\
+      if (p.word == 0) continue;\
+      if (p.rgba.a == 0xff) {\
+        *d = p;\
+        continue;\
+      }\
+      ia = 0xff - p.rgba.a;\
+      d->rgba.r = MIN(p.rgba.r + MUL255(d->rgba.r, ia), 0xff);\
+      d->rgba.g = MIN(p.rgba.g + MUL255(d->rgba.g, ia), 0xff);\
+      d->rgba.b = MIN(p.rgba.b + MUL255(d->rgba.b, ia), 0xff);\
+      d->rgba.a = MIN(p.rgba.a + MUL255(d->rgba.a, ia), 0xff);\
+    }\
+  }
+
+PREMUL_SPAN(premulSpan000, 0, 0, 0)
+PREMUL_SPAN(premulSpan001, 0, 0, 1)
+PREMUL_SPAN(premulSpan010, 0, 1, 0)
+PREMUL_SPAN(premulSpan011, 0, 1, 1)
+PREMUL_SPAN(premulSpan100, 1, 0, 0)
+PREMUL_SPAN(premulSpan101, 1, 0, 1)
+PREMUL_SPAN(premulSpan110, 1, 1, 0)
+PREMUL_SPAN(premulSpan111, 1, 1, 1)
+
+static BlendFunc premulSpans[8] = BLEND_SPANS_ENTRY(premulSpan);
+
+
+/* Internal blend mode which writes the source unchanged, used to render
+ * rotation cache entries */
+#define BLEND_REPLACE (SR_BLEND_DIFFERENCE + 1)
+
+static void blendSpanReplace(sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n) {
+  (void) m;
+  memcpy(d, s, n * sizeof(*d));
+}
+
+
+/* The other blend modes, and premultiplied sources drawn to straight buffers,
+ * convert a span at a time and use the regular spans */
+static void blendSpanConvert(
+  sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n, int src, int dst
+) {
+  sr_Pixel sbuf[SPAN_MAX], dbuf[SPAN_MAX];
+  int blend = (m->blend > SR_BLEND_DIFFERENCE) ? SR_BLEND_ALPHA : m->blend;
+  BlendFunc fn = blendSpans[blend][getSpanIndex(m, 0)];
+  sr_Pixel *ps;
+  int k;
+  while (n > 0) {
+    k = MIN(n, SPAN_MAX);
+    ps = s;
+    if (src) {
+      memcpy(sbuf, s, k * sizeof(*s));
+      unpremultiplyPixels(sbuf, k);
+      ps = sbuf;
+    }
+    if (dst) {
+      memcpy(dbuf, d, k * sizeof(*d));
+      unpremultiplyPixels(dbuf, k);
+      fn(m, dbuf, ps, k);
+      premultiplyPixels(dbuf, k);
+      memcpy(d, dbuf, k * sizeof(*d));
+    } else {
+      fn(m, d, ps, k);
+    }
+    d += k;
+    s += k;
+    n -= k;
+  }
+}
+
+
+static void blendSpanConvertSource(
+  sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n
+) {
+  blendSpanConvert(m, d, s, n, 1, 0);
+}
+
+
+static void blendSpanConvertDest(
+  sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n
+) {
+  blendSpanConvert(m, d, s, n, 0, 1);
+}
+
+
+static void blendSpanConvertBoth(
+  sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n
+) {
+  blendSpanConvert(m, d, s, n, 1, 1);
+}
+
+
+/* Bilinear sampling. Sample positions are fixed point source coordinates of
+ * pixel centers; the four taps around a position are clamped to the `s` rect
+ * so that nothing outside of it bleeds in, and are interpolated horizontally
+ * then vertically with 8bit weights. Taps of a straight alpha source which
+ * aren't all opaque are interpolated premultiplied so that the color of
+ * transparent pixels doesn't darken edges */
+
+#define LERP_TAP(a, b, f) (((a) * (256 - (f)) + (b) * (f)) >> 8)
+
+static int getTaps(
+  sr_Buffer *src, sr_Rect *s, int sx, int sy, sr_Pixel *t, int *fx, int *fy
+) {
+  int x0, y0, x1, y1;
+  sr_Pixel *r0, *r1;
+  sx -= FX_UNIT / 2;
+  sy -= FX_UNIT / 2;
+  x0 = sx >> FX_BITS;
+  y0 = sy >> FX_BITS;
+  *fx = (sx & FX_MASK) >> (FX_BITS - 8);
+  *fy = (sy & FX_MASK) >> (FX_BITS - 8);
+  if (x0 < s->x) { x0 = s->x; *fx = 0; }
+  if (y0 < s->y) { y0 = s->y; *fy = 0; }
+  if (x0 >= s->x + s->w - 1) { x0 = s->x + s->w - 1; *fx = 0; }
+  if (y0 >= s->y + s->h - 1) { y0 = s->y + s->h - 1; *fy = 0; }
+  x1 = MIN(x0 + 1, s->x + s->w - 1);
+  y1 = MIN(y0 + 1, s->y + s->h - 1);
+  r0 = src->pixels + y0 * src->stride;
+  r1 = src->pixels + y1 * src->stride;
+  t[0] = r0[x0];
+  t[1] = r0[x1];
+  t[2] = r1[x0];
+  t[3] = r1[x1];
+  /* Premultiply if needed; returns true if the result should be converted
+   * back */
+  if (IS_PREMUL(src)) return 0;
+  if (~(t[0].word & t[1].word & t[2].word & t[3].word) & ALPHA_MASK) {
+    t[0] = sr_premultiply(t[0]);
+    t[1] = sr_premultiply(t[1]);
+    t[2] = sr_premultiply(t[2]);
+    t[3] = sr_premultiply(t[3]);
+    return 1;
+  }
+  return 0;
+}
+
+
+static void sampleLinear(
+  sr_Pixel *d, sr_Buffer *src, sr_Rect *s,
+  int sx, int sy, int sxi, int syi, int n
+) {
+  sr_Pixel t[4];
+  int fx, fy, convert;
+  for (; n--; d++, sx += sxi, sy += syi) {
+    convert = getTaps(src, s, sx, sy, t, &fx, &fy);
+    #define X(c)\
+      d->rgba.c = LERP_TAP(LERP_TAP(t[0].rgba.c, t[1].rgba.c, fx),\
+                           LERP_TAP(t[2].rgba.c, t[3].rgba.c, fx), fy);
+    X(r) X(g) X(b) X(a)
+    #undef X
+    if (convert) {
+      *d = sr_unpremultiply(*d);
+    }
+  }
+}
+
+
+#if USE_SSE2
+
+/* Interpolates all four channels at once; the left and top taps' products
+ * are in the low half of the register and the right and bottom taps' in the
+ * high half. Results match sampleLinear() */
+static void sampleLinearSSE2(
+  sr_Pixel *d, sr_Buffer *src, sr_Rect *s,
+  int sx, int sy, int sxi, int syi, int n
+) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i v, lo, hi, w;
+  sr_Pixel t[4];
+  int fx, fy, convert;
+  for (; n--; d++, sx += sxi, sy += syi) {
+    convert = getTaps(src, s, sx, sy, t, &fx, &fy);
+    v = _mm_loadu_si128((__m128i*) t);
+    /* Horizontal */
+    w = _mm_set_epi16(fx, fx, fx, fx, 256 - fx, 256 - fx, 256 - fx, 256 - fx);
+    lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), w);
+    hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), w);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_si128(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_si128(hi, 8)), 8);
+    /* Vertical */
+    w = _mm_set_epi16(fy, fy, fy, fy, 256 - fy, 256 - fy, 256 - fy, 256 - fy);
+    v = _mm_mullo_epi16(_mm_unpacklo_epi64(lo, hi), w);
+    v = _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_si128(v, 8)), 8);
+    d->word = _mm_cvtsi128_si32(_mm_packus_epi16(v, zero));
+    if (convert) {
+      *d = sr_unpremultiply(*d);
+    }
+  }
+}
+
+#endif
+
+
+#if USE_SSE2
+
+/* The span kernel below is written once in terms of the V_ macros and
+ * instantiated for each instruction set. Pixels are processed in groups of
+ * V_N, unpacked to 16bit channels where a multiply is needed. A group with any
+ * pixel which needs compositing onto a translucent destination is handed to
+ * the matching scalar span so that results stay identical */
+
+#define BLEND_OP_ALPHA(s, d)    (s)
+#define BLEND_OP_COLOR(s, d)    (color)
+#define BLEND_OP_ADD(s, d)      (V_ADDS8(d, s))
+#define BLEND_OP_SUBTRACT(s, d)\
+  (V_ANDNOT(V_CMPEQ8(V_SUBS8(s, d), zero), V_SUB8(d, s)))
+#define BLEND_OP_MULTIPLY(s, d)\
+  (V_PACK16(V_SRL16(V_MULLO16(V_UNPACKLO8(s, zero), V_UNPACKLO8(d, zero)), 8),\
+            V_SRL16(V_MULLO16(V_UNPACKHI8(s, zero), V_UNPACKHI8(d, zero)), 8)))
+#define BLEND_OP_LIGHTEN(s, d)  (V_SELECT(V_CMPGT32(V_SUM(s), V_SUM(d)), s, d))
+#define BLEND_OP_DARKEN(s, d)   (V_SELECT(V_CMPGT32(V_SUM(d), V_SUM(s)), s, d))
+#define BLEND_OP_SCREEN(s, d)\
+  (V_XOR(BLEND_OP_MULTIPLY(V_XOR(s, V_SET32(-1)), V_XOR(d, V_SET32(-1))),\
+         V_SET32(-1)))
+#define BLEND_OP_DIFFERENCE(s, d) (V_OR(V_SUBS8(s, d), V_SUBS8(d, s)))
+
+/* Does the blend operation only touch the rgb channels? */
+#define BLEND_RGB_ALPHA       0
+#define BLEND_RGB_COLOR       0
+#define BLEND_RGB_ADD         1
+#define BLEND_RGB_SUBTRACT    1
+#define BLEND_RGB_MULTIPLY    1
+#define BLEND_RGB_LIGHTEN     0
+#define BLEND_RGB_DARKEN      0
+#define BLEND_RGB_SCREEN      1
+#define BLEND_RGB_DIFFERENCE  1
+
+#define V_SELECT(m, a, b) (V_OR(V_AND(m, a), V_ANDNOT(m, b)))
+#define V_CHANNEL(v, shift) (V_SRL32(V_SLL32(v, 24 - (shift)), 24))
+#define V_SUM(v)\
+  (V_ADD32(V_AND(V_HSUM16(v), V_SET32(0xffff)), V_SRL32(V_HSUM16(v), 16)))
+#define V_HSUM16(v)\
+  (V_ADD32(V_AND(V_AND(v, rgbmask), V_SET32(0xff00ff)),\
+           V_AND(V_SRL32(V_AND(v, rgbmask), 8), V_SET32(0xff00ff))))
+
+/* Lerps the unpacked 16bit channels of `d` towards `s` by `a`, matching the
+ * arithmetic shift of the scalar LERP() macro */
+#define V_LERP16(d, s, a)\
+  (V_ADD16(d, V_ADD16(V_SLL16(V_MULHI16(V_SUB16(s, d), a), 8),\
+                      V_SRL16(V_MULLO16(V_SUB16(s, d), a), 8))))
+
+#define BLEND_SPAN_SIMD(NAME, BLEND, OPAQUE)\
+  static V_ATTR void NAME(sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n) {\
+    BlendFunc scalar = blendSpans[SR_BLEND_##BLEND][getSpanIndex(m, OPAQUE)];\
+    V_T zero = V_ZERO();\
+    V_T rgbmask = V_SET32(SR_RGB_MASK);\
+    V_T amask = V_SET32(ALPHA_MASK);\
+    V_T color = V_SET32(m->color.word);\
+    V_T tint = V_UNPACKLO8(color, zero);\
+    V_T galpha = V_SET32(m->alpha);\
+    int tinted = m->color.word != SR_RGB_MASK;\
+    for (; n >= V_N; n -= V_N, d += V_N, s += V_N) {\
+      V_T vs = V_LOAD(s);\
+      V_T vd = V_LOAD(d);\
+      V_T a, skip, full, opaque, res;\
+      /* Alpha */\
+      a = V_SRL32(V_MULLO16(V_CHANNEL(vs, ALPHA_SHIFT), galpha), 8);\
+      skip = V_CMPGT32(V_SET32(2), a);\
+      if (V_MASK(skip) == V_MASKALL) continue;\
+      full = V_CMPGT32(a, V_SET32(253));\
+      opaque = OPAQUE ? V_SET32(-1) :\
+               V_CMPGT32(V_CHANNEL(vd, ALPHA_SHIFT), V_SET32(253));\
+      if (V_MASK(V_OR(V_OR(skip, full), opaque)) != V_MASKALL) {\
+        scalar(m, d, s, V_N);\
+        continue;\
+      }\
+      /* Color */\
+      if (tinted) {\
+        res = V_PACK16(\
+          V_SRL16(V_MULLO16(V_UNPACKLO8(vs, zero), tint), 8),\
+          V_SRL16(V_MULLO16(V_UNPACKHI8(vs, zero), tint), 8));\
+        vs = V_OR(V_AND(res, rgbmask), V_AND(vs, amask));\
+      }\
+      /* Blend */\
+      res = BLEND_OP_##BLEND(vs, vd);\
+      if (BLEND_RGB_##BLEND) {\
+        res = V_OR(V_AND(res, rgbmask), V_AND(vs, amask));\
+      }\
+      /* Write */\
+      if (V_MASK(full) != V_MASKALL) {\
+        V_T a16 = V_OR(a, V_SLL32(a, 16));\
+        V_T lerp = V_PACK16(\
+          V_LERP16(V_UNPACKLO8(vd, zero), V_UNPACKLO8(res, zero),\
+                   V_UNPACKLO32(a16, a16)),\
+          V_LERP16(V_UNPACKHI8(vd, zero), V_UNPACKHI8(res, zero),\
+                   V_UNPACKHI32(a16, a16)));\
+        lerp = V_OR(V_AND(lerp, rgbmask), V_AND(vd, amask));\
+        res = V_SELECT(full, res, V_SELECT(skip, vd, lerp));\
+      }\
+      V_STORE(d, res);\
+    }\
+    scalar(m, d, s, n);\
+  }
+
+/* Computes (x * y) / 255 on unpacked channels, rounded as MUL255() */
+#define V_MUL255(x, y)\
+  (V_SRL16(V_ADD16(V_ADD16(V_MULLO16(x, y), half),\
+                   V_SRL16(V_ADD16(V_MULLO16(x, y), half), 8)), 8))
+
+#define PREMUL_SPAN_SIMD(NAME, PREMUL)\
+  static V_ATTR void NAME(sr_DrawMode *m, sr_Pixel *d, sr_Pixel *s, int n) {\
+    BlendFunc scalar = premulSpans[getSpanIndex(m, PREMUL)];\
+    V_T zero = V_ZERO();\
+    V_T half = V_SET32(0x00800080);\
+    V_T amask = V_SET32(ALPHA_MASK);\
+    V_T amask16 = V_UNPACKLO8(amask, zero);\
+    V_T tint = V_OR(V_UNPACKLO8(V_SET32(m->color.word), zero), amask16);\
+    V_T galpha = V_SET32(m->alpha | (m->alpha << 16));\
+    int tinted = m->color.word != SR_RGB_MASK;\
+    int faded = m->alpha != 0xff;\
+    for (; n >= V_N; n -= V_N, d += V_N, s += V_N) {\
+      V_T vs = V_LOAD(s);\
+      V_T vd, lo, hi, a;\
+      /* Nothing to draw? */\
+      if (V_MASK(V_CMPEQ8(PREMUL ? vs : V_AND(vs, amask), zero)) ==\
+          V_MASKALL) continue;\
+      lo = V_UNPACKLO8(vs, zero);\
+      hi = V_UNPACKHI8(vs, zero);\
+      /* Premultiply */\
+      if (!PREMUL) {\
+        a = V_CHANNEL(vs, ALPHA_SHIFT);\
+        a = V_OR(a, V_SLL32(a, 16));\
+        lo = V_MUL255(lo, V_OR(V_UNPACKLO32(a, a), amask16));\
+        hi = V_MUL255(hi, V_OR(V_UNPACKHI32(a, a), amask16));\
+      }\
+      /* Color and alpha */\
+      if (tinted) {\
+        lo = V_MUL255(lo, tint);\
+        hi = V_MUL255(hi, tint);\
+      }\
+      if (faded) {\
+        lo = V_MUL255(lo, galpha);\
+        hi = V_MUL255(hi, galpha);\
+      }\
+      vs = V_PACK16(lo, hi);\
+      /* Source over */\
+      a = V_XOR(V_CHANNEL(vs, ALPHA_SHIFT), V_SET32(0xff));\
+      a = V_OR(a, V_SLL32(a, 16));\
+      vd = V_LOAD(d);\
+      lo = V_MUL255(V_UNPACKLO8(vd, zero), V_UNPACKLO32(a, a));\
+      hi = V_MUL255(V_UNPACKHI8(vd, zero), V_UNPACKHI32(a, a));\
+      V_STORE(d, V_ADDS8(vs, V_PACK16(lo, hi)));\
+    }\
+    scalar(m, d, s, n);\
+  }
+
+#define BLEND_SPANS_SIMD_MODE(NAME, BLEND)\
+  BLEND_SPAN_SIMD(NAME##0, BLEND, 0)\
+  BLEND_SPAN_SIMD(NAME##1, BLEND, 1)
+
+#define BLEND_SPANS_SIMD(PREFIX)\
+  BLEND_SPANS_SIMD_MODE(PREFIX##Alpha,      ALPHA)\
+  BLEND_SPANS_SIMD_MODE(PREFIX##Color,      COLOR)\
+  BLEND_SPANS_SIMD_MODE(PREFIX##Add,        ADD)\
+  BLEND_SPANS_SIMD_MODE(PREFIX##Subtract,   SUBTRACT)\
+  BLEND_SPANS_SIMD_MODE(PREFIX##Multiply,   MULTIPLY)\
+  BLEND_SPANS_SIMD_MODE(PREFIX##Lighten,    LIGHTEN)\
+  BLEND_SPANS_SIMD_MODE(PREFIX##Darken,     DARKEN)\
+  BLEND_SPANS_SIMD_MODE(PREFIX##Screen,     SCREEN)\
+  BLEND_SPANS_SIMD_MODE(PREFIX##Difference, DIFFERENCE)\
+  static BlendFunc PREFIX##Funcs[][2] = {\
+    { PREFIX##Alpha0,      PREFIX##Alpha1      },\
+    { PREFIX##Color0,      PREFIX##Color1      },\
+    { PREFIX##Add0,        PREFIX##Add1        },\
+    { PREFIX##Subtract0,   PREFIX##Subtract1   },\
+    { PREFIX##Multiply0,   PREFIX##Multiply1   },\
+    { PREFIX##Lighten0,    PREFIX##Lighten1    },\
+    { PREFIX##Darken0,     PREFIX##Darken1     },\
+    { PREFIX##Screen0,     PREFIX##Screen1     },\
+    { PREFIX##Difference0, PREFIX##Difference1 },\
+  };\
+  PREMUL_SPAN_SIMD(PREFIX##Premul0, 0)\
+  PREMUL_SPAN_SIMD(PREFIX##Premul1, 1)\
+  static BlendFunc PREFIX##PremulFuncs[] = {\
+    PREFIX##Premul0, PREFIX##Premul1\
+  };
+
+/* SSE2 */
+#define V_ATTR
+#define V_T               __m128i
+#define V_N               4
+#define V_MASKALL         0xffff
+#define V_LOAD(p)         _mm_loadu_si128((V_T*) (p))
+#define V_STORE(p, v)     _mm_storeu_si128((V_T*) (p), v)
+#define V_MASK(v)         _mm_movemask_epi8(v)
+#define V_ZERO            _mm_setzero_si128
+#define V_SET32           _mm_set1_epi32
+#define V_AND             _mm_and_si128
+#define V_OR              _mm_or_si128
+#define V_XOR             _mm_xor_si128
+#define V_ANDNOT          _mm_andnot_si128
+#define V_ADDS8           _mm_adds_epu8
+#define V_SUBS8           _mm_subs_epu8
+#define V_SUB8            _mm_sub_epi8
+#define V_CMPEQ8          _mm_cmpeq_epi8
+#define V_ADD16           _mm_add_epi16
+#define V_SUB16           _mm_sub_epi16
+#define V_MULLO16         _mm_mullo_epi16
+#define V_MULHI16         _mm_mulhi_epi16
+#define V_SLL16           _mm_slli_epi16
+#define V_SRL16           _mm_srli_epi16
+#define V_ADD32           _mm_add_epi32
+#define V_SLL32           _mm_slli_epi32
+#define V_SRL32           _mm_srli_epi32
+#define V_CMPGT32         _mm_cmpgt_epi32
+#define V_UNPACKLO8       _mm_unpacklo_epi8
+#define V_UNPACKHI8       _mm_unpackhi_epi8
+#define V_UNPACKLO32      _mm_unpacklo_epi32
+#define V_UNPACKHI32      _mm_unpackhi_epi32
+#define V_PACK16          _mm_packus_epi16
+
+BLEND_SPANS_SIMD(blendSpanSSE2)
+
+#undef V_ATTR
+#undef V_T
+#undef V_N
+#undef V_MASKALL
+#undef V_LOAD
+#undef V_STORE
+#undef V_MASK
+#undef V_ZERO
+#undef V_SET32
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_ANDNOT
+#undef V_ADDS8
+#undef V_SUBS8
+#undef V_SUB8
+#undef V_CMPEQ8
+#undef V_ADD16
+#undef V_SUB16
+#undef V_MULLO16
+#undef V_MULHI16
+#undef V_SLL16
+#undef V_SRL16
+#undef V_ADD32
+#undef V_SLL32
+#undef V_SRL32
+#undef V_CMPGT32
+#undef V_UNPACKLO8
+#undef V_UNPACKHI8
+#undef V_UNPACKLO32
+#undef V_UNPACKHI32
+#undef V_PACK16
+
+#endif
+
+
+#if USE_AVX2
+
+/* AVX2 -- unpack and pack work within each 128bit lane, so pixel order is
+ * preserved the same as with SSE2 */
+#define V_ATTR            __attribute__((target("avx2")))
+#define V_T               __m256i
+#define V_N               8
+#define V_MASKALL         -1
+#define V_LOAD(p)         _mm256_loadu_si256((V_T*) (p))
+#define V_STORE(p, v)     _mm256_storeu_si256((V_T*) (p), v)
+#define V_MASK(v)         _mm256_movemask_epi8(v)
+#define V_ZERO            _mm256_setzero_si256
+#define V_SET32           _mm256_set1_epi32
+#define V_AND             _mm256_and_si256
+#define V_OR              _mm256_or_si256
+#define V_XOR             _mm256_xor_si256
+#define V_ANDNOT          _mm256_andnot_si256
+#define V_ADDS8           _mm256_adds_epu8
+#define V_SUBS8           _mm256_subs_epu8
+#define V_SUB8            _mm256_sub_epi8
+#define V_CMPEQ8          _mm256_cmpeq_epi8
+#define V_ADD16           _mm256_add_epi16
+#define V_SUB16           _mm256_sub_epi16
+#define V_MULLO16         _mm256_mullo_epi16
+#define V_MULHI16         _mm256_mulhi_epi16
+#define V_SLL16           _mm256_slli_epi16
+#define V_SRL16           _mm256_srli_epi16
+#define V_ADD32           _mm256_add_epi32
+#define V_SLL32           _mm256_slli_epi32
+#define V_SRL32           _mm256_srli_epi32
+#define V_CMPGT32         _mm256_cmpgt_epi32
+#define V_UNPACKLO8       _mm256_unpacklo_epi8
+#define V_UNPACKHI8       _mm256_unpackhi_epi8
+#define V_UNPACKLO32      _mm256_unpacklo_epi32
+#define V_UNPACKHI32      _mm256_unpackhi_epi32
+#define V_PACK16          _mm256_packus_epi16
+
+BLEND_SPANS_SIMD(blendSpanAVX2)
+
+#endif
+
+
+static void initBlendFuncs(void) {
+  sampleLinearFunc = sampleLinear;
+  simdSpans = NULL;
+  simdPremulSpans = NULL;
+  if (!useSimd) return;
+#if USE_SSE2
+  sampleLinearFunc = sampleLinearSSE2;
+  simdSpans = blendSpanSSE2Funcs;
+  simdPremulSpans = blendSpanSSE2PremulFuncs;
+#endif
+#if USE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    simdSpans = blendSpanAVX2Funcs;
+    simdPremulSpans = blendSpanAVX2PremulFuncs;
+  }
+#endif
+}
+
+
+/* Gets the span function for drawing to `b` from a source which is
+ * premultiplied if `premul` is set */
+static BlendFunc getBlendFunc(sr_Buffer *b, int premul) {
+  sr_DrawMode *m = &b->mode;
+  int blend = (m->blend > SR_BLEND_DIFFERENCE) ? SR_BLEND_ALPHA : m->blend;
+  int opaque = !!(b->flags & SR_BUFFER_OPAQUE);
+  if (m->blend == BLEND_REPLACE) {
+    return blendSpanReplace;
+  }
+  premul = !!premul;
+  if (IS_PREMUL(b)) {
+    if (blend != SR_BLEND_ALPHA) {
+      return premul ? blendSpanConvertBoth : blendSpanConvertDest;
+    }
+    if (simdPremulSpans) {
+      return simdPremulSpans[premul];
+    }
+    return premulSpans[getSpanIndex(m, premul)];
+  }
+  if (premul) {
+    return blendSpanConvertSource;
+  }
+  if (simdSpans) {
+    return simdSpans[blend][opaque];
+  }
+  return blendSpans[blend][getSpanIndex(m, opaque)];
+}
+
+
+static void drawPixel(sr_Buffer *b, sr_Pixel c, int x, int y) {
   if (
     x >= b->clip.x && x < b->clip.x + b->clip.w &&
     y >= b->clip.y && y < b->clip.y + b->clip.h
   ) {
-    blendPixel(&b->mode, b->pixels + x + y * b->w, c);
+    getBlendFunc(b, 0)(&b->mode, b->pixels + x + y * b->stride, &c, 1);
   }
 }
 
 
-void sr_drawLine(sr_Buffer *b, sr_Pixel c, int x0, int y0, int x1, int y1) {
+/* Marks the part of `r` inside the clip rect dirty */
+static void markClipped(sr_Buffer *b, sr_Rect r) {
+  clipRect(&r, &b->clip);
+  prepareWrite(b, r);
+}
+
+
+void sr_drawPixel(sr_Buffer *b, sr_Pixel c, int x, int y) {
+  sync(b);
+  markClipped(b, sr_rect(x, y, 1, 1));
+  drawPixel(b, c, x, y);
+}
+
+
+static void drawRect(sr_Buffer *b, sr_Pixel c, sr_Rect r, sr_Rect *region) {
+  sr_Pixel buf[SPAN_MAX];
+  sr_Pixel *p;
   int x, y;
-  int deltax, deltay;
-  int error;
-  int ystep;
+  BlendFunc blend = getBlendFunc(b, 0);
+  clipRect(&r, region);
+  /* Fill source span with color */
+  x = MIN(r.w, SPAN_MAX);
+  while (x--) {
+    buf[x] = c;
+  }
+  /* Draw */
+  y = r.h;
+  while (y--) {
+    p = b->pixels + r.x + (r.y + y) * b->stride;
+    for (x = 0; x < r.w; x += SPAN_MAX) {
+      blend(&b->mode, p + x, buf, MIN(r.w - x, SPAN_MAX));
+    }
+  }
+}
+
+
+/* Lines are clipped before they are walked: the range of steps which land
+ * inside the clip rect is worked out from Bresenham's error term, and the
+ * walk starts at the first of them with the error term it would have had
+ * there, so exactly the pixels of the unclipped line are drawn. Horizontal
+ * and vertical lines are drawn as rects. If `skipFirst` is set the line's
+ * first point isn't drawn, so polylines don't draw shared points twice */
+static void drawLine(
+  sr_Buffer *b, sr_Pixel c, int x0, int y0, int x1, int y1, int skipFirst
+) {
+  BlendFunc blend;
+  sr_Pixel *p;
+  long long e0, m;
+  int k, k0, k1, lo, hi, mlo, mhi, cmin, cmax;
+  int dx, dy, error, majorStep, minorStep;
   int steep = abs(y1 - y0) > abs(x1 - x0);
+  int ystep;
   if (steep) {
     SWAP(int, x0, y0);
     SWAP(int, x1, y1);
   }
+  /* Steps are numbered from x0; `k0` and `k1` are the first and last steps
+   * to draw */
+  k0 = 0;
+  k1 = abs(x1 - x0);
   if (x0 > x1) {
     SWAP(int, x0, x1);
     SWAP(int, y0, y1);
+    if (skipFirst) k1--;
+  } else if (skipFirst) {
+    k0++;
   }
-  deltax = x1 - x0;
-  deltay = abs(y1 - y0);
-  error = deltax / 2;
+  dx = x1 - x0;
+  dy = abs(y1 - y0);
   ystep = (y0 < y1) ? 1 : -1;
-  y = y0;
-  for (x = x0; x <= x1; x++) {
+  /* Clip steps to the major axis */
+  lo = steep ? b->clip.y : b->clip.x;
+  hi = lo + (steep ? b->clip.h : b->clip.w) - 1;
+  k0 = MAX(k0, lo - x0);
+  k1 = MIN(k1, hi - x0);
+  cmin = steep ? b->clip.x : b->clip.y;
+  cmax = cmin + (steep ? b->clip.w : b->clip.h) - 1;
+  if (dy == 0) {
+    if (k0 > k1 || y0 < cmin || y0 > cmax) return;
     if (steep) {
-      sr_drawPixel(b, c, y, x);
+      drawRect(b, c, sr_rect(y0, x0 + k0, 1, k1 - k0 + 1), &b->clip);
     } else {
-      sr_drawPixel(b, c, x, y);
+      drawRect(b, c, sr_rect(x0 + k0, y0, k1 - k0 + 1, 1), &b->clip);
     }
-    error -= deltay;
+    return;
+  }
+  /* Clip steps to the minor axis; `m` is the number of minor steps taken */
+  e0 = dx / 2;
+  mlo = (ystep > 0) ? cmin - y0 : y0 - cmax;
+  mhi = (ystep > 0) ? cmax - y0 : y0 - cmin;
+  mlo = MAX(mlo, 0);
+  if (mlo > mhi) return;
+  if (mlo > 0) {
+    k0 = MAX(k0, ((mlo - 1) * (long long) dx + e0) / dy + 1);
+  }
+  k1 = MIN(k1, (mhi * (long long) dx + e0) / dy);
+  if (k0 > k1) return;
+  /* Start at the first step */
+  m = k0 * (long long) dy - e0;
+  m = (m > 0) ? (m + dx - 1) / dx : 0;
+  error = e0 - k0 * (long long) dy + m * dx;
+  y0 += ystep * m;
+  x0 += k0;
+  if (steep) {
+    p = b->pixels + y0 + x0 * b->stride;
+    majorStep = b->stride;
+    minorStep = ystep;
+  } else {
+    p = b->pixels + x0 + y0 * b->stride;
+    majorStep = 1;
+    minorStep = ystep * b->stride;
+  }
+  /* Walk */
+  blend = getBlendFunc(b, 0);
+  for (k = k0; k <= k1; k++) {
+    blend(&b->mode, p, &c, 1);
+    error -= dy;
     if (error < 0) {
-      y += ystep;
-      error += deltax;
+      p += minorStep;
+      error += dx;
     }
+    p += majorStep;
+  }
+}
+
+
+void sr_drawLine(sr_Buffer *b, sr_Pixel c, int x0, int y0, int x1, int y1) {
+  sync(b);
+  markClipped(b, sr_rect(MIN(x0, x1), MIN(y0, y1),
+                         abs(x1 - x0) + 1, abs(y1 - y0) + 1));
+  drawLine(b, c, x0, y0, x1, y1, 0);
+}
+
+
+void sr_drawPolyline(sr_Buffer *b, sr_Pixel c, int *points, int n) {
+  int i, x0, y0, x1, y1;
+  if (n < 1) return;
+  sync(b);
+  /* Mark the bounds of all the points */
+  x0 = x1 = points[0];
+  y0 = y1 = points[1];
+  for (i = 1; i < n; i++) {
+    x0 = MIN(x0, points[i * 2]);
+    y0 = MIN(y0, points[i * 2 + 1]);
+    x1 = MAX(x1, points[i * 2]);
+    y1 = MAX(y1, points[i * 2 + 1]);
+  }
+  markClipped(b, sr_rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1));
+  /* Draw */
+  if (n == 1) {
+    drawLine(b, c, points[0], points[1], points[0], points[1], 0);
+  }
+  for (i = 1; i < n; i++) {
+    drawLine(b, c, points[i * 2 - 2], points[i * 2 - 1],
+             points[i * 2], points[i * 2 + 1], i > 1);
   }
 }
 
 
 void sr_drawRect(sr_Buffer *b, sr_Pixel c, int x, int y, int w, int h) {
-  sr_Pixel *p;
-  sr_Rect r = sr_rect(x, y, w, h);
-  clipRect(&r, &b->clip);
-  y = r.h;
-  while (y--) {
-    x = r.w;
-    p = b->pixels + r.x + (r.y + y) * b->w;
-    while (x--) {
-      blendPixel(&b->mode, p++, c);
-    }
+  Command cmd;
+  sr_Rect r;
+  if ((b->flags & SR_BUFFER_A8) && b->mode.blend == SR_BLEND_ALPHA) {
+    sync(b);
+    r = sr_rect(x, y, w, h);
+    clipRect(&r, &b->clip);
+    fillA8(b, c, r, 1);
+    return;
   }
+  cmd.type = CMD_RECT;
+  cmd.color = c;
+  cmd.src = NULL;
+  cmd.rect = sr_rect(x, y, w, h);
+  dispatch(b, &cmd);
 }
 
 
@@ -558,12 +2306,20 @@ void sr_drawBox(sr_Buffer *b, sr_Pixel c, int x, int y, int w, int h) {
   do {\
     int y__ = (y);\
     if (y__ >= 0 && ~rows[y__ >> 5] & (1 << (y__ & 31))) {\
-      sr_drawRect(b, c, x, y__, len, 1);\
+      if (direct) {\
+        drawRect(b, c, sr_rect(x, y__, len, 1), &b->clip);\
+      } else {\
+        sr_drawRect(b, c, x, y__, len, 1);\
+      }\
       rows[y__ >> 5] |= 1 << (y__ & 31);\
     }\
   } while (0)
 
-void sr_drawCircle(sr_Buffer *b, sr_Pixel c, int x, int y, int r) {
+/* Draws a circle's rows as rects, which are dispatched unless `direct` is
+ * set, in which case the caller has synced and marked the buffer */
+static void drawCircle(
+  sr_Buffer *b, sr_Pixel c, int x, int y, int r, int direct
+) {
   int dx = abs(r);
   int dy = 0;
   int radiusError = 1 - dx;
@@ -592,6 +2348,11 @@ void sr_drawCircle(sr_Buffer *b, sr_Pixel c, int x, int y, int r) {
 #undef DRAW_ROW
 
 
+void sr_drawCircle(sr_Buffer *b, sr_Pixel c, int x, int y, int r) {
+  drawCircle(b, c, x, y, r, 0);
+}
+
+
 void sr_drawRing(sr_Buffer *b, sr_Pixel c, int x, int y, int r) {
   /* TODO : Prevent against overdraw? */
   int dx = abs(r);
@@ -600,16 +2361,18 @@ void sr_drawRing(sr_Buffer *b, sr_Pixel c, int x, int y, int r) {
   /* Clipped completely off-screen? */
   if (x + dx < b->clip.x || x - dx > b->clip.x + b->clip.w ||
       y + dx < b->clip.y || y - dx > b->clip.y + b->clip.h) return;
+  sync(b);
+  markClipped(b, sr_rect(x - dx, y - dx, dx * 2 + 1, dx * 2 + 1));
   /* Draw */
   while (dx >= dy) {
-    sr_drawPixel(b, c,  dx + x,  dy + y);
-    sr_drawPixel(b, c,  dy + x,  dx + y);
-    sr_drawPixel(b, c, -dx + x,  dy + y);
-    sr_drawPixel(b, c, -dy + x,  dx + y);
-    sr_drawPixel(b, c, -dx + x, -dy + y);
-    sr_drawPixel(b, c, -dy + x, -dx + y);
-    sr_drawPixel(b, c,  dx + x, -dy + y);
-    sr_drawPixel(b, c,  dy + x, -dx + y);
+    drawPixel(b, c,  dx + x,  dy + y);
+    drawPixel(b, c,  dy + x,  dx + y);
+    drawPixel(b, c, -dx + x,  dy + y);
+    drawPixel(b, c, -dy + x,  dx + y);
+    drawPixel(b, c, -dx + x, -dy + y);
+    drawPixel(b, c, -dy + x, -dx + y);
+    drawPixel(b, c,  dx + x, -dy + y);
+    drawPixel(b, c,  dy + x, -dx + y);
     dy++;
     if (radiusError < 0) {
       radiusError += 2 * dy + 1;
@@ -621,29 +2384,247 @@ void sr_drawRing(sr_Buffer *b, sr_Pixel c, int x, int y, int r) {
 }
 
 
+/* The batch draws take `n` primitives, each as a run of ints in `f`, and a
+ * color for each. The primitives are drawn directly rather than dispatched
+ * as commands, so the whole batch costs a single sync and dirty rect */
+
+enum { BATCH_PIXELS, BATCH_LINES, BATCH_RECTS, BATCH_CIRCLES };
+
+static void drawBatch(sr_Buffer *b, int type, sr_Pixel *c, int *f, int n) {
+  static const int fields[] = { 2, 4, 4, 3 };
+  int i, k, x0, y0, x1, y1;
+  int *p;
+  if (n <= 0) return;
+  k = fields[type];
+  sync(b);
+  /* Mark the bounds of all the primitives */
+  x0 = y0 = INT_MAX;
+  x1 = y1 = INT_MIN;
+  for (i = 0, p = f; i < n; i++, p += k) {
+    switch (type) {
+      case BATCH_PIXELS:
+        x0 = MIN(x0, p[0]);
+        y0 = MIN(y0, p[1]);
+        x1 = MAX(x1, p[0]);
+        y1 = MAX(y1, p[1]);
+        break;
+      case BATCH_LINES:
+        x0 = MIN(x0, MIN(p[0], p[2]));
+        y0 = MIN(y0, MIN(p[1], p[3]));
+        x1 = MAX(x1, MAX(p[0], p[2]));
+        y1 = MAX(y1, MAX(p[1], p[3]));
+        break;
+      case BATCH_RECTS:
+        if (p[2] <= 0 || p[3] <= 0) break;
+        x0 = MIN(x0, p[0]);
+        y0 = MIN(y0, p[1]);
+        x1 = MAX(x1, p[0] + p[2] - 1);
+        y1 = MAX(y1, p[1] + p[3] - 1);
+        break;
+      case BATCH_CIRCLES:
+        x0 = MIN(x0, p[0] - abs(p[2]));
+        y0 = MIN(y0, p[1] - abs(p[2]));
+        x1 = MAX(x1, p[0] + abs(p[2]));
+        y1 = MAX(y1, p[1] + abs(p[2]));
+        break;
+    }
+  }
+  if (x0 > x1 || y0 > y1) return;
+  markClipped(b, sr_rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1));
+  /* Draw */
+  for (i = 0, p = f; i < n; i++, p += k) {
+    switch (type) {
+      case BATCH_PIXELS:
+        drawPixel(b, c[i], p[0], p[1]);
+        break;
+      case BATCH_LINES:
+        drawLine(b, c[i], p[0], p[1], p[2], p[3], 0);
+        break;
+      case BATCH_RECTS:
+        drawRect(b, c[i], sr_rect(p[0], p[1], p[2], p[3]), &b->clip);
+        break;
+      case BATCH_CIRCLES:
+        drawCircle(b, c[i], p[0], p[1], p[2], 1);
+        break;
+    }
+  }
+}
+
+
+void sr_drawPixels(sr_Buffer *b, sr_Pixel *c, int *xy, int n) {
+  drawBatch(b, BATCH_PIXELS, c, xy, n);
+}
+
+
+void sr_drawLines(sr_Buffer *b, sr_Pixel *c, int *lines, int n) {
+  drawBatch(b, BATCH_LINES, c, lines, n);
+}
+
+
+void sr_drawRects(sr_Buffer *b, sr_Pixel *c, int *rects, int n) {
+  drawBatch(b, BATCH_RECTS, c, rects, n);
+}
+
+
+void sr_drawCircles(sr_Buffer *b, sr_Pixel *c, int *circles, int n) {
+  drawBatch(b, BATCH_CIRCLES, c, circles, n);
+}
+
+
+/* A buffer's run index splits each row into runs of transparent, opaque and
+ * translucent pixels so that draws can skip or copy whole runs. It is built
+ * when a buffer is drawn for the RUN_MIN_USES'th time without being written
+ * to in between, and is invalidated by prepareWrite(), which every write
+ * goes through */
+
+static int getRunType(sr_Buffer *b, sr_Pixel p) {
+  if (IS_PREMUL(b) ? p.word == 0 : p.rgba.a == 0) {
+    return RUN_CLEAR;
+  }
+  return (p.rgba.a == 0xff) ? RUN_OPAQUE : RUN_BLEND;
+}
+
+
+static int pushRun(sr_RunIndex *r, int *count, int end, int type) {
+  if (*count == r->capacity) {
+    int n = r->capacity ? r->capacity << 1 : 256;
+    int *runs = realloc(r->runs, n * sizeof(*runs));
+    if (!runs) return 0;
+    r->runs = runs;
+    r->capacity = n;
+  }
+  r->runs[(*count)++] = (end << 2) | type;
+  return 1;
+}
+
+
+static void buildRuns(sr_Buffer *b) {
+  sr_RunIndex *r = b->runs;
+  sr_Pixel *p;
+  int *rows;
+  int x, y, type, t, count = 0;
+  rows = realloc(r->rows, (b->h + 1) * sizeof(*rows));
+  if (!rows) return;
+  r->rows = rows;
+  for (y = 0; y < b->h; y++) {
+    p = b->pixels + y * b->stride;
+    rows[y] = count;
+    type = getRunType(b, p[0]);
+    for (x = 1; x < b->w; x++) {
+      t = getRunType(b, p[x]);
+      if (t != type) {
+        if (!pushRun(r, &count, x, type)) return;
+        type = t;
+      }
+    }
+    if (!pushRun(r, &count, b->w, type)) return;
+  }
+  rows[b->h] = count;
+  r->valid = 1;
+}
+
+
+static void useRuns(sr_Buffer *b) {
+  /* A view's pixels can be written through its parent without it knowing;
+   * 8-bit buffers are expanded as they're drawn so don't use runs */
+  if (b->parent || IS_8BIT(b)) return;
+  if (!b->runs) {
+    b->runs = calloc(1, sizeof(*b->runs));
+    if (!b->runs) return;
+  }
+  if (!b->runs->valid && ++b->runs->uses >= RUN_MIN_USES) {
+    buildRuns(b);
+  }
+}
+
+
+/* Gets the source's run index if it is built and up to date. The index is
+ * only built from dispatch() as it must not happen while tiles or bands are
+ * being drawn on several threads */
+static sr_RunIndex *getRuns(sr_Buffer *b) {
+  return (b->runs && b->runs->valid) ? b->runs : NULL;
+}
+
+
+/* Gets the first run in row `y` which ends after column `x` */
+static int findRun(sr_RunIndex *r, int y, int x) {
+  int lo = r->rows[y];
+  int hi = r->rows[y + 1] - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) >> 1;
+    if (RUN_END(r->runs[mid]) <= x) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+
+/* Can opaque source pixels be copied to the destination as they are? */
+static int canCopyOpaque(sr_Buffer *b) {
+  return b->mode.blend == SR_BLEND_ALPHA && b->mode.alpha == 0xff &&
+         b->mode.color.word == SR_RGB_MASK;
+}
+
+
+/* Gets the sampling function for filtered draws to `b`, or NULL if sampling
+ * is nearest neighbour */
+static SampleFunc getSampleFunc(sr_Buffer *b) {
+  return (b->mode.filter == SR_FILTER_LINEAR) ? sampleLinearFunc : NULL;
+}
+
+
 static void drawBufferBasic(
-  sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s
+  sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s, sr_Rect *r
 ) {
-  int ix, iy;
+  int iy, i, cx, ex, run;
+  sr_Pixel buf[SPAN_MAX];
   sr_Pixel *pd, *ps;
-  /* Clip to destination buffer */
-  clipRectAndOffset(&s, &x, &y, &b->clip);
+  BlendFunc blend = getBlendFunc(b, IS_PREMUL(src));
+  sr_RunIndex *runs = getRuns(src);
+  int copy = canCopyOpaque(b);
+  /* Clip to destination region */
+  clipRectAndOffset(&s, &x, &y, r);
   /* Clipped off screen? */
   if (s.w <= 0 || s.h <= 0) return;
   /* Draw */
   for (iy = 0; iy < s.h; iy++) {
-    pd = b->pixels + x + (y + iy) * b->w;
-    ps = src->pixels + s.x + (s.y + iy) * src->w;
-    ix = s.w;
-    while (ix--) {
-      blendPixel(&b->mode, pd++, *ps++);
+    pd = b->pixels + x + (y + iy) * b->stride - s.x;
+    if (IS_8BIT(src)) {
+      /* Expand and blend as spans */
+      for (cx = s.x; cx < s.x + s.w; cx += SPAN_MAX) {
+        i = MIN(s.x + s.w - cx, SPAN_MAX);
+        expandPixels(src, buf, cx, s.y + iy, i);
+        blend(&b->mode, pd + cx, buf, i);
+      }
+      continue;
+    }
+    ps = src->pixels + (s.y + iy) * src->stride;
+    if (!runs) {
+      blend(&b->mode, pd + s.x, ps + s.x, s.w);
+      continue;
+    }
+    /* Skip transparent runs, copy opaque ones if we can and blend the rest */
+    i = findRun(runs, s.y + iy, s.x);
+    for (cx = s.x; cx < s.x + s.w; cx = ex) {
+      run = runs->runs[i++];
+      ex = MIN(RUN_END(run), s.x + s.w);
+      if (RUN_TYPE(run) == RUN_CLEAR) continue;
+      if (RUN_TYPE(run) == RUN_OPAQUE && copy) {
+        memcpy(pd + cx, ps + cx, (ex - cx) * sizeof(*pd));
+      } else {
+        blend(&b->mode, pd + cx, ps + cx, ex - cx);
+      }
     }
   }
 }
 
 
 static void drawBufferScaled(
-  sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s, sr_Transform a
+  sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s, sr_Transform a,
+  sr_Rect *r
 ) {
   float absSx = (a.sx < 0) ? -a.sx : a.sx;
   float absSy = (a.sy < 0) ? -a.sy : a.sy;
@@ -653,8 +2634,15 @@ static void drawBufferScaled(
   int osy = (a.sy < 0) ? (s.h << FX_BITS) - 1 : 0;
   int ix = (s.w << FX_BITS) / a.sx / s.w;
   int iy = (s.h << FX_BITS) / a.sy / s.h;
-  int odx, dx, dy, sx, sy;
-  int d;
+  int odx, dx, dy, sx, sy, dx0, dx1, dy1;
+  int d, i, n, row, run;
+  sr_Pixel buf[SPAN_MAX];
+  sr_Pixel *ps, *pd;
+  BlendFunc blend = getBlendFunc(b, IS_PREMUL(src));
+  SampleFunc sample = getSampleFunc(b);
+  sr_RunIndex *runs = (ix != 0 && !sample) ? getRuns(src) : NULL;
+  int copy = canCopyOpaque(b);
+  sr_Rect sub = s;
   /* Adjust x/y depending on origin */
   x = x - ((a.sx < 0) ? w : 0) - (a.sx < 0 ? -1 : 1) * a.ox * absSx;
   y = y - ((a.sy < 0) ? h : 0) - (a.sy < 0 ? -1 : 1) * a.oy * absSy;
@@ -667,17 +2655,61 @@ static void drawBufferScaled(
   if ((d = (b->clip.x - x)) > 0) { odx = d; s.x += d / a.sx; }
   if ((d = ((y + h) - (b->clip.y + b->clip.h))) > 0) { h -= d; }
   if ((d = ((x + w) - (b->clip.x + b->clip.w))) > 0) { w -= d; }
-  /* Draw */
+  /* Restrict to region -- source positions are still stepped from the clipped
+   * origin so that the result does not depend on the region */
+  dx0 = MAX(odx, r->x - x);
+  dx1 = MIN(w, r->x + r->w - x);
+  dy1 = MIN(h, r->y + r->h - y);
   sy = osy;
-  while (dy < h) {
-    dx = odx;
-    sx = osx;
-    while (dx < w) {
-      blendPixel(&b->mode, b->pixels + (x + dx) + (y + dy) * b->w,
-                 src->pixels[(s.x + (sx >> FX_BITS)) +
-                             (s.y + (sy >> FX_BITS)) * src->w]);
-      sx += ix;
-      dx++;
+  if ((d = (r->y - y) - dy) > 0) { dy += d; sy += d * iy; }
+  /* Draw */
+  while (dy < dy1) {
+    dx = dx0;
+    sx = osx + (dx0 - odx) * ix;
+    row = s.y + (sy >> FX_BITS);
+    ps = src->pixels + s.x + row * src->stride;
+    while (dx < dx1) {
+      n = MIN(dx1 - dx, SPAN_MAX);
+      pd = b->pixels + (x + dx) + (y + dy) * b->stride;
+      if (runs) {
+        /* Limit the span to the destination pixels which sample from the
+         * current source run */
+        i = findRun(runs, row, s.x + (sx >> FX_BITS));
+        run = runs->runs[i];
+        if (ix > 0) {
+          d = ((RUN_END(run) - s.x) * FX_UNIT - sx + ix - 1) / ix;
+        } else {
+          d = (i > runs->rows[row]) ? RUN_END(runs->runs[i - 1]) : 0;
+          d = (sx - (d - s.x) * FX_UNIT) / -ix + 1;
+        }
+        n = MIN(n, d);
+        if (RUN_TYPE(run) == RUN_CLEAR) {
+          sx += ix * n;
+          dx += n;
+          continue;
+        }
+        if (RUN_TYPE(run) == RUN_OPAQUE && copy) {
+          for (i = 0; i < n; i++) {
+            pd[i] = ps[sx >> FX_BITS];
+            sx += ix;
+          }
+          dx += n;
+          continue;
+        }
+      }
+      /* Gather source pixels and blend as a span */
+      if (sample) {
+        sample(buf, src, &sub, (s.x << FX_BITS) + sx + ix / 2,
+               (s.y << FX_BITS) + sy + iy / 2, ix, 0, n);
+        sx += ix * n;
+      } else {
+        for (i = 0; i < n; i++) {
+          buf[i] = ps[sx >> FX_BITS];
+          sx += ix;
+        }
+      }
+      blend(&b->mode, pd, buf, n);
+      dx += n;
     }
     sy += iy;
     dy++;
@@ -687,18 +2719,21 @@ static void drawBufferScaled(
 
 static void drawScanline(
   sr_Buffer *b, sr_Buffer *src, sr_Rect *s, int left, int right,
-  int dy, int sx, int sy, int sxIncr, int syIncr
+  int dy, int sx, int sy, int sxIncr, int syIncr, sr_Point *center, sr_Rect *r
 ) {
-  int d, dx;
+  int d, dx, i, n;
   int x, y;
+  sr_Pixel buf[SPAN_MAX];
+  BlendFunc blend = getBlendFunc(b, IS_PREMUL(src));
+  SampleFunc sample = getSampleFunc(b);
   /* Adjust for clipping */
-  if (dy < b->clip.y || dy >= b->clip.y + b->clip.h) return;
-  if ((d = b->clip.x - left) > 0) {
+  if (dy < r->y || dy >= r->y + r->h) return;
+  if ((d = r->x - left) > 0) {
     left += d;
     sx += d * sxIncr;
     sy += d * syIncr;
   }
-  if ((d = right - (b->clip.x + b->clip.w)) > 0) {
+  if ((d = right - (r->x + r->w)) > 0) {
     right -= d;
   }
   /* Does the scaline length go out of bounds of our `s` rect? If so we
@@ -724,29 +2759,30 @@ checkSourceRight:
   /* Draw */
   dx = left;
   while (dx < right) {
-    blendPixel(&b->mode, b->pixels + dx + dy * b->w,
-               src->pixels[(sx >> FX_BITS) +
-                           (sy >> FX_BITS) * src->w]);
-#if 0
-    /* DEBUG : Out of bounds? draw pink pixels */
-    /* TODO : Remove this */
-    if ((sx >> FX_BITS) < 0 || (sx >> FX_BITS) >= src->w ||
-        (sy >> FX_BITS) < 0 || (sy >> FX_BITS) >= src->h
-    ) {
-      sr_drawPixel(b, sr_color(255, 0, 255), dx, dy);
+    /* Gather source pixels and blend as a span */
+    n = MIN(right - dx, SPAN_MAX);
+    if (sample) {
+      sample(buf, src, s, sx + center->x, sy + center->y, sxIncr, syIncr, n);
+      sx += sxIncr * n;
+      sy += syIncr * n;
+    } else {
+      for (i = 0; i < n; i++) {
+        buf[i] = src->pixels[(sx >> FX_BITS) + (sy >> FX_BITS) * src->stride];
+        sx += sxIncr;
+        sy += syIncr;
+      }
     }
-#endif
-    sx += sxIncr;
-    sy += syIncr;
-    dx++;
+    blend(&b->mode, b->pixels + dx + dy * b->stride, buf, n);
+    dx += n;
   }
 }
 
 
 static void drawBufferRotatedScaled(
-  sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s, sr_Transform a
+  sr_Buffer *b, sr_Buffer *src, int x, int y, sr_Rect s, sr_Transform a,
+  sr_Rect *r
 ) {
-  sr_Point p[4], top, bottom, left, right;
+  sr_Point p[4], top, bottom, left, right, center;
   int dy, xl, xr, il, ir;
   int sx, sy, sxi, syi, sxoi, syoi;
   int tsx, tsy, tsxi, tsyi;
@@ -778,7 +2814,7 @@ static void drawBufferRotatedScaled(
   bottom = p[(-q + 2) & 3];
   left   = p[(-q + 3) & 3];
   /* Clipped completely off screen? */
-  if (bottom.y < b->clip.y || top.y  >= b->clip.y + b->clip.h) return;
+  if (bottom.y < r->y || top.y  >= r->y + r->h) return;
   if (right.x  < b->clip.x || left.x >= b->clip.x + b->clip.w) return;
   /* Destination */
   xl = xr = top.x << FX_BITS;
@@ -789,6 +2825,12 @@ static void drawBufferRotatedScaled(
   syi  = xdiv(s.h << FX_BITS, h) * sin(-a.r);
   sxoi = xdiv(s.w << FX_BITS, left.y - top.y) * sinq;
   syoi = xdiv(s.h << FX_BITS, left.y - top.y) * cosq;
+  /* Offset from a destination pixel's corner to its center in the source,
+   * used when filtering */
+  center.x = (xdiv(s.w << FX_BITS, w) * (cos(-a.r) + sinr)) / 2;
+  center.y = (xdiv(s.h << FX_BITS, h) * (sin(-a.r) + cosr)) / 2;
+  if (invX) center.x = -center.x;
+  if (invY) center.y = -center.y;
   switch (q) {
     default:
     case 0:
@@ -833,7 +2875,7 @@ static void drawBufferRotatedScaled(
     }
     /* Draw row */
     drawScanline(b, src, &s, xl >> FX_BITS, xr >> FX_BITS, dy,
-                 tsx, tsy, tsxi, tsyi);
+                 tsx, tsy, tsxi, tsyi, &center, r);
     sx += sxoi;
     sy += syoi;
     xl += il;
@@ -852,36 +2894,1115 @@ static void drawBufferRotatedScaled(
 }
 
 
+/* Triangles are rasterized with edge functions on vertices snapped to
+ * 1/256th of a pixel. A pixel is drawn if its center is inside the triangle,
+ * or on an edge which is a top or left edge, so triangles sharing an edge
+ * never both draw the pixels along it */
+
+#define TRI_BITS (8)
+#define TRI_UNIT (1 << TRI_BITS)
+#define TRI_MAX  (1 << 20)
+
+typedef struct { long long x, y; } TriVertex;
+
+typedef struct {
+  long long dx, dy, bias;
+  TriVertex a;
+} TriEdge;
+
+
+static long long floorDiv(long long n, long long d) {
+  return (n >= 0) ? n / d : -((-n + d - 1) / d);
+}
+
+
+static void initTriEdge(TriEdge *e, TriVertex a, TriVertex b) {
+  e->a = a;
+  e->dx = b.x - a.x;
+  e->dy = b.y - a.y;
+  /* Pixels on a top or left edge are inside, on any other edge outside */
+  e->bias = (e->dy < 0 || (e->dy == 0 && e->dx > 0)) ? 0 : -1;
+}
+
+
+/* Narrows the span [*left, *right) of row `py` (a fixed point pixel center)
+ * to the pixels on the inner side of the edge */
+static void clipTriEdge(TriEdge *e, long long py, int *left, int *right) {
+  long long c = e->dx * (py - e->a.y) + e->dy * e->a.x + e->bias;
+  long long x;
+  if (e->dy == 0) {
+    if (c < 0) *right = *left;
+  } else if (e->dy > 0) {
+    /* Inside while dy * px <= c */
+    x = floorDiv(floorDiv(c, e->dy) - TRI_UNIT / 2, TRI_UNIT) + 1;
+    if (x < *right) *right = MAX(x, *left);
+  } else {
+    /* Inside while -dy * px >= -c */
+    x = -floorDiv(floorDiv(c, -e->dy) + TRI_UNIT / 2, TRI_UNIT);
+    if (x > *left) *left = MIN(x, *right);
+  }
+}
+
+
+static void drawTriangle(sr_Buffer *b, sr_Buffer *src, float *xy, float *uv) {
+  sr_Pixel buf[SPAN_MAX];
+  BlendFunc blend = getBlendFunc(b, IS_PREMUL(src));
+  SampleFunc sample = getSampleFunc(b);
+  sr_Rect s = sr_rect(0, 0, src->w, src->h);
+  TriVertex v[3];
+  TriEdge e[3];
+  long long area;
+  float det, dudx, dudy, dvdx, dvdy, fx, fy;
+  int i, x, y, n, y0, y1, left, right, su, sv, sui, svi;
+  sr_Pixel *p;
+  for (i = 0; i < 3; i++) {
+    v[i].x = llround(CLAMP(xy[i * 2], -TRI_MAX, TRI_MAX) * TRI_UNIT);
+    v[i].y = llround(CLAMP(xy[i * 2 + 1], -TRI_MAX, TRI_MAX) * TRI_UNIT);
+  }
+  /* Wind the vertices so the inside of each edge is on its left */
+  area = (v[1].x - v[0].x) * (v[2].y - v[0].y) -
+         (v[1].y - v[0].y) * (v[2].x - v[0].x);
+  if (area == 0) return;
+  if (area < 0) {
+    initTriEdge(&e[0], v[0], v[2]);
+    initTriEdge(&e[1], v[2], v[1]);
+    initTriEdge(&e[2], v[1], v[0]);
+  } else {
+    initTriEdge(&e[0], v[0], v[1]);
+    initTriEdge(&e[1], v[1], v[2]);
+    initTriEdge(&e[2], v[2], v[0]);
+  }
+  /* Get the gradients of the texture coordinates */
+  det = (xy[2] - xy[0]) * (xy[5] - xy[1]) - (xy[4] - xy[0]) * (xy[3] - xy[1]);
+  if (det == 0) return;
+  dudx = ((uv[2] - uv[0]) * (xy[5] - xy[1]) -
+          (uv[4] - uv[0]) * (xy[3] - xy[1])) / det;
+  dudy = ((uv[4] - uv[0]) * (xy[2] - xy[0]) -
+          (uv[2] - uv[0]) * (xy[4] - xy[0])) / det;
+  dvdx = ((uv[3] - uv[1]) * (xy[5] - xy[1]) -
+          (uv[5] - uv[1]) * (xy[3] - xy[1])) / det;
+  dvdy = ((uv[5] - uv[1]) * (xy[2] - xy[0]) -
+          (uv[3] - uv[1]) * (xy[4] - xy[0])) / det;
+  sui = dudx * FX_UNIT;
+  svi = dvdx * FX_UNIT;
+  /* Get the rows the triangle covers inside the clip rect */
+  fy = floor(MIN(xy[1], MIN(xy[3], xy[5])));
+  y0 = MAX(fy, b->clip.y);
+  fy = ceil(MAX(xy[1], MAX(xy[3], xy[5])));
+  y1 = MIN(fy, b->clip.y + b->clip.h);
+  /* Draw */
+  for (y = y0; y < y1; y++) {
+    left = b->clip.x;
+    right = b->clip.x + b->clip.w;
+    for (i = 0; i < 3; i++) {
+      clipTriEdge(&e[i], ((long long) y << TRI_BITS) + TRI_UNIT / 2,
+                  &left, &right);
+    }
+    if (left >= right) continue;
+    /* Get the texture coordinates at the center of the span's first pixel */
+    fx = left + 0.5f - xy[0];
+    fy = y + 0.5f - xy[1];
+    su = (uv[0] + dudx * fx + dudy * fy) * FX_UNIT;
+    sv = (uv[1] + dvdx * fx + dvdy * fy) * FX_UNIT;
+    p = b->pixels + y * b->stride;
+    for (x = left; x < right; x += n) {
+      /* Gather source pixels and blend as a span */
+      n = MIN(right - x, SPAN_MAX);
+      if (sample) {
+        sample(buf, src, &s, su, sv, sui, svi, n);
+        su += sui * n;
+        sv += svi * n;
+      } else {
+        for (i = 0; i < n; i++) {
+          buf[i] = src->pixels[CLAMP(su >> FX_BITS, 0, src->w - 1) +
+                               CLAMP(sv >> FX_BITS, 0, src->h - 1) *
+                               src->stride];
+          su += sui;
+          sv += svi;
+        }
+      }
+      blend(&b->mode, p + x, buf, n);
+    }
+  }
+}
+
+
+void sr_drawTriangles(
+  sr_Buffer *b, sr_Buffer *src, float *xy, float *uv, int *indices, int n
+) {
+  sr_Buffer tmp;
+  float txy[6], tuv[6];
+  float x0, y0, x1, y1;
+  int i, j, k, count;
+  if (n <= 0) return;
+  /* 8-bit and wrapped sources are drawn from a 32-bit copy */
+  if (IS_8BIT(src) || IS_WRAPPED(src)) {
+    sync(src);
+    if (!expandBuffer(&tmp, src, sr_rect(0, 0, src->w, src->h))) return;
+    sr_drawTriangles(b, &tmp, xy, uv, indices, n);
+    free(tmp.pixels);
+    return;
+  }
+  sync(b);
+  sync(src);
+  /* Mark the bounds of all the vertices */
+  count = 0;
+  for (i = 0; i < n * 3; i++) {
+    k = indices ? indices[i] : i;
+    count = MAX(count, k + 1);
+  }
+  x0 = x1 = xy[0];
+  y0 = y1 = xy[1];
+  for (i = 1; i < count; i++) {
+    x0 = MIN(x0, xy[i * 2]);
+    y0 = MIN(y0, xy[i * 2 + 1]);
+    x1 = MAX(x1, xy[i * 2]);
+    y1 = MAX(y1, xy[i * 2 + 1]);
+  }
+  x0 = floor(CLAMP(x0, -TRI_MAX, TRI_MAX));
+  y0 = floor(CLAMP(y0, -TRI_MAX, TRI_MAX));
+  x1 = ceil(CLAMP(x1, -TRI_MAX, TRI_MAX));
+  y1 = ceil(CLAMP(y1, -TRI_MAX, TRI_MAX));
+  markClipped(b, sr_rect(x0, y0, x1 - x0, y1 - y0));
+  /* Draw */
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 3; j++) {
+      k = indices ? indices[i * 3 + j] : i * 3 + j;
+      txy[j * 2]     = xy[k * 2];
+      txy[j * 2 + 1] = xy[k * 2 + 1];
+      tuv[j * 2]     = uv[k * 2];
+      tuv[j * 2 + 1] = uv[k * 2 + 1];
+    }
+    drawTriangle(b, src, txy, tuv);
+  }
+}
+
+
+/* A buffer with a rotation cache draws rotated through pre-rendered copies
+ * of itself at `steps` evenly spaced angles. Copies are rendered on first
+ * use, keyed by the rotation step, sub rect, scale, origin and filter, and
+ * are then drawn as a plain blit. All cached copies share a memory budget;
+ * the least recently used ones are freed to stay within it, and a buffer's
+ * copies are freed when it is written to */
+
+static void unlinkRotation(RotationEntry *e) {
+  if (e->prev) e->prev->next = e->next; else rotationsHead = e->next;
+  if (e->next) e->next->prev = e->prev; else rotationsTail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+
+static void pushRotation(RotationEntry *e) {
+  e->prev = NULL;
+  e->next = rotationsHead;
+  if (rotationsHead) rotationsHead->prev = e; else rotationsTail = e;
+  rotationsHead = e;
+}
+
+
+static void freeRotation(RotationEntry *e) {
+  RotationEntry **p;
+  sr_RotationCache *c = e->src->rotations;
+  int i;
+  for (i = 0; i < c->steps; i++) {
+    for (p = &c->bins[i]; *p; p = &(*p)->link) {
+      if (*p == e) {
+        *p = e->link;
+        goto found;
+      }
+    }
+  }
+found:
+  unlinkRotation(e);
+  rotationsUsed -= e->buffer->w * e->buffer->h * sizeof(sr_Pixel);
+  sr_destroyBuffer(e->buffer);
+  free(e);
+}
+
+
+static void clearRotations(sr_Buffer *b) {
+  sr_RotationCache *c = b->rotations;
+  int i;
+  for (i = 0; i < c->steps; i++) {
+    while (c->bins[i]) {
+      freeRotation(c->bins[i]);
+    }
+  }
+}
+
+
+static void trimRotations(int size) {
+  while (rotationsTail && rotationsUsed + size > rotationsBudget) {
+    freeRotation(rotationsTail);
+  }
+}
+
+
+void sr_setRotationCacheBudget(int bytes) {
+  rotationsBudget = MAX(bytes, 0);
+  trimRotations(0);
+}
+
+
+void sr_setRotationCache(sr_Buffer *b, int steps) {
+  sr_RotationCache *c = b->rotations;
+  /* Views can't tell when their pixels change, nor indexed buffers when
+   * their palette's colors do, so don't cache */
+  if (b->parent || (b->flags & SR_BUFFER_INDEXED)) return;
+  if (c) {
+    if (c->steps == steps) return;
+    clearRotations(b);
+    free(c->bins);
+    free(c);
+    b->rotations = NULL;
+  }
+  if (steps > 0) {
+    c = calloc(1, sizeof(*c));
+    if (!c) return;
+    c->bins = calloc(steps, sizeof(*c->bins));
+    if (!c->bins) {
+      free(c);
+      return;
+    }
+    c->steps = steps;
+    b->rotations = c;
+  }
+}
+
+
+static RotationEntry *renderRotation(
+  sr_Buffer *b, Command *c, int step, float r
+) {
+  sr_RotationCache *rc = c->src->rotations;
+  sr_Transform *t = &c->t;
+  RotationEntry *e;
+  Command cmd;
+  float cosr = cos(r);
+  float sinr = sin(r);
+  float px, py, x0, y0, x1, y1;
+  int i, w, h, size;
+  /* Get the bounds of the rotated rect around its origin */
+  x0 = y0 = 1e9;
+  x1 = y1 = -1e9;
+  for (i = 0; i < 4; i++) {
+    px = (((i & 1) ? c->rect.w : 0) - t->ox) * t->sx;
+    py = (((i & 2) ? c->rect.h : 0) - t->oy) * t->sy;
+    x0 = MIN(x0, cosr * px - sinr * py);
+    y0 = MIN(y0, sinr * px + cosr * py);
+    x1 = MAX(x1, cosr * px - sinr * py);
+    y1 = MAX(y1, sinr * px + cosr * py);
+  }
+  /* Make room for it */
+  w = ceil(x1) - floor(x0) + 4;
+  h = ceil(y1) - floor(y0) + 4;
+  size = w * h * sizeof(sr_Pixel);
+  if (size > rotationsBudget) return NULL;
+  trimRotations(size);
+  /* Render */
+  e = calloc(1, sizeof(*e));
+  if (!e) return NULL;
+  e->buffer = sr_newBuffer(w, h);
+  if (!e->buffer) {
+    free(e);
+    return NULL;
+  }
+  e->buffer->flags |= IS_PREMUL(c->src);
+  e->buffer->mode.blend = BLEND_REPLACE;
+  e->buffer->mode.filter = b->mode.filter;
+  sr_clear(e->buffer, sr_pixel(0, 0, 0, 0));
+  e->src = c->src;
+  e->rect = c->rect;
+  e->sx = t->sx;
+  e->sy = t->sy;
+  e->ox = t->ox;
+  e->oy = t->oy;
+  e->filter = b->mode.filter;
+  e->cx = 2 - floor(x0);
+  e->cy = 2 - floor(y0);
+  cmd = *c;
+  cmd.t.r = r;
+  cmd.x = e->cx;
+  cmd.y = e->cy;
+  dispatch(e->buffer, &cmd);
+  /* Add to cache */
+  e->link = rc->bins[step];
+  rc->bins[step] = e;
+  pushRotation(e);
+  rotationsUsed += size;
+  return e;
+}
+
+
+/* Turns a rotated draw into a blit of a cached rotation if the source has a
+ * rotation cache */
+static void useRotationCache(sr_Buffer *b, Command *c) {
+  sr_RotationCache *rc = c->src->rotations;
+  RotationEntry *e;
+  int step;
+  if (SAME_PIXELS(c->src, b)) return;
+  step = (int) floor(c->t.r / PI2 * rc->steps + .5) % rc->steps;
+  if (step == 0) {
+    c->t.r = 0;
+    return;
+  }
+  /* Find or render */
+  for (e = rc->bins[step]; e; e = e->link) {
+    if (
+      e->rect.x == c->rect.x && e->rect.y == c->rect.y &&
+      e->rect.w == c->rect.w && e->rect.h == c->rect.h &&
+      e->sx == c->t.sx && e->sy == c->t.sy &&
+      e->ox == c->t.ox && e->oy == c->t.oy &&
+      e->filter == b->mode.filter
+    ) {
+      unlinkRotation(e);
+      pushRotation(e);
+      break;
+    }
+  }
+  if (!e) {
+    e = renderRotation(b, c, step, step * PI2 / rc->steps);
+    if (!e) return;
+  }
+  /* Draw as a blit */
+  c->src = e->buffer;
+  c->rect = sr_rect(0, 0, e->buffer->w, e->buffer->h);
+  c->t = sr_transform();
+  c->x -= e->cx;
+  c->y -= e->cy;
+}
+
+
+/* Splits the rect `s` of a wrapping buffer into the at most 4 rects its
+ * pixels are stored in, each with its offset into `s` */
+static int wrapRects(
+  sr_Buffer *b, sr_Rect s, sr_Rect *rects, sr_Point *offsets
+) {
+  int xs[2], ws[2], ys[2], hs[2];
+  int i, j, n = 0;
+  xs[0] = (s.x + b->ox) % b->w;
+  ws[0] = MIN(s.w, b->w - xs[0]);
+  xs[1] = 0;
+  ws[1] = s.w - ws[0];
+  ys[0] = (s.y + b->oy) % b->h;
+  hs[0] = MIN(s.h, b->h - ys[0]);
+  ys[1] = 0;
+  hs[1] = s.h - hs[0];
+  for (j = 0; j < 2; j++) {
+    for (i = 0; i < 2; i++) {
+      if (ws[i] <= 0 || hs[j] <= 0) continue;
+      rects[n] = sr_rect(xs[i], ys[j], ws[i], hs[j]);
+      offsets[n].x = i ? ws[0] : 0;
+      offsets[n].y = j ? hs[0] : 0;
+      n++;
+    }
+  }
+  return n;
+}
+
+
+/* Dispatches a command which reads from a buffer, picking the cached
+ * rotation or mipmap level it should read from */
+static void dispatchLevel(sr_Buffer *b, Command *c) {
+  if (c->t.r != 0 && c->src->rotations) {
+    useRotationCache(b, c);
+  } else if (c->t.r == 0 && c->src->mipmap) {
+    useMipmaps(b, c);
+  }
+  dispatch(b, c);
+}
+
+
+/* An unscaled, unrotated command reading from a wrapped buffer is
+ * dispatched once for each part of its rect, each part moved by its offset.
+ * Any other such command reads from an unwrapped copy of its rect when it
+ * is executed, as separately scaled parts wouldn't meet exactly */
+static void dispatchSource(sr_Buffer *b, Command *c) {
+  sr_Rect rects[4];
+  sr_Point offsets[4];
+  Command cmd;
+  int i, n;
+  if (!IS_WRAPPED(c->src)) {
+    dispatchLevel(b, c);
+    return;
+  }
+  if (c->t.r != 0 || c->t.sx != 1 || c->t.sy != 1) {
+    dispatch(b, c);
+    return;
+  }
+  n = wrapRects(c->src, c->rect, rects, offsets);
+  for (i = 0; i < n; i++) {
+    cmd = *c;
+    cmd.rect = rects[i];
+    cmd.x += offsets[i].x;
+    cmd.y += offsets[i].y;
+    dispatch(b, &cmd);
+  }
+}
+
+
 void sr_drawBuffer(
   sr_Buffer *b, sr_Buffer *src, int x, int y,
   sr_Rect *sub, sr_Transform *t
 ) {
-  sr_Rect s;
+  Command cmd;
   /* Init sub rect */
   if (sub) {
     if (sub->w <= 0 || sub->h <= 0) return;
-    s = *sub;
-    check(s.x >= 0 && s.y >= 0 && s.x + s.w <= src->w && s.y + s.h <= src->h,
+    cmd.rect = *sub;
+    check(sub->x >= 0 && sub->y >= 0 &&
+          sub->x + sub->w <= src->w && sub->y + sub->h <= src->h,
           "sr_drawBuffer", "sub rectangle out of bounds");
   } else {
-    s = sr_rect(0, 0, src->w, src->h);
+    cmd.rect = sr_rect(0, 0, src->w, src->h);
+  }
+  /* Init transform */
+  if (t) {
+    cmd.t = *t;
+    /* Move rotation value into 0..PI2 range */
+    cmd.t.r = fmod(fmod(cmd.t.r, PI2) + PI2, PI2);
+  } else {
+    cmd.t = sr_transform();
   }
   /* Draw */
-  if (!t) {
-    drawBufferBasic(b, src, x, y, s);
+  cmd.type = CMD_BUFFER;
+  cmd.src = src;
+  cmd.x = x;
+  cmd.y = y;
+  dispatchSource(b, &cmd);
+}
+
+
+/* Executes a command with an 8-bit or wrapped source from a temporary
+ * 32-bit copy of the part of the source it reads */
+static void executeExpanded(sr_Buffer *b, Command *c, sr_Rect *r) {
+  sr_Buffer tmp;
+  Command cmd = *c;
+  if (!expandBuffer(&tmp, c->src, c->rect)) return;
+  cmd.src = &tmp;
+  cmd.rect = sr_rect(0, 0, c->rect.w, c->rect.h);
+  execute(b, &cmd, r);
+  free(tmp.pixels);
+}
+
+
+static void drawBuffer(sr_Buffer *b, Command *c, sr_Rect *r) {
+  sr_Transform a = c->t;
+  int x = c->x;
+  int y = c->y;
+  /* Not rotated or scaled? apply offset and draw basic */
+  if (a.r == 0 && a.sx == 1 && a.sy == 1) {
+    x -= a.ox;
+    y -= a.oy;
+    drawBufferBasic(b, c->src, x, y, c->rect, r);
+  } else if (IS_8BIT(c->src) || IS_WRAPPED(c->src)) {
+    executeExpanded(b, c, r);
+  } else if (a.r == 0) {
+    drawBufferScaled(b, c->src, x, y, c->rect, a, r);
   } else {
-    sr_Transform a = *t;
-    /* Move rotation value into 0..PI2 range */
-    a.r = fmod(fmod(a.r, PI2) + PI2, PI2);
-    /* Not rotated or scaled? apply offset and draw basic */
-    if (a.r == 0 && a.sx == 1 && a.sy == 1) {
-      x -= a.ox;
-      y -= a.oy;
-      drawBufferBasic(b, src, x, y, s);
-    } else if (a.r == 0) {
-      drawBufferScaled(b, src, x, y, s, a);
+    drawBufferRotatedScaled(b, c->src, x, y, c->rect, a, r);
+  }
+}
+
+
+/* Draws `src` centered on each of the `n` points, each with its own scale
+ * and alpha. The copies are drawn directly rather than dispatched as
+ * commands, so a large number of them costs a single sync and dirty rect */
+void sr_drawParticles(
+  sr_Buffer *b, sr_Buffer *src, int x, int y,
+  float *px, float *py, float *scale, float *alpha, int n
+) {
+  sr_Buffer tmp;
+  Command cmd;
+  float s, x0, y0, x1, y1;
+  int i;
+  if (n <= 0) return;
+  /* 8-bit and wrapped sources are drawn from a 32-bit copy */
+  if (IS_8BIT(src) || IS_WRAPPED(src)) {
+    sync(src);
+    if (!expandBuffer(&tmp, src, sr_rect(0, 0, src->w, src->h))) return;
+    sr_drawParticles(b, &tmp, x, y, px, py, scale, alpha, n);
+    free(tmp.pixels);
+    return;
+  }
+  sync(b);
+  sync(src);
+  cmd.type = CMD_BUFFER;
+  cmd.src = src;
+  cmd.rect = sr_rect(0, 0, src->w, src->h);
+  cmd.t = sr_transform();
+  cmd.t.ox = src->w / 2;
+  cmd.t.oy = src->h / 2;
+  /* Mark the bounds of all the particles */
+  x0 = y0 = 1e9;
+  x1 = y1 = -1e9;
+  for (i = 0; i < n; i++) {
+    s = fabs(scale[i]);
+    x0 = MIN(x0, px[i] - src->w * s);
+    y0 = MIN(y0, py[i] - src->h * s);
+    x1 = MAX(x1, px[i] + src->w * s);
+    y1 = MAX(y1, py[i] + src->h * s);
+  }
+  x0 = CLAMP(x0, -1e8, 1e8);
+  y0 = CLAMP(y0, -1e8, 1e8);
+  x1 = CLAMP(x1, -1e8, 1e8);
+  y1 = CLAMP(y1, -1e8, 1e8);
+  markClipped(b, sr_rect(x + x0 - 2, y + y0 - 2, x1 - x0 + 4, y1 - y0 + 4));
+  /* Draw; each particle is drawn to a copy of the buffer holding its alpha,
+   * as recorded commands are, so `b`'s draw mode is never changed */
+  tmp = *b;
+  for (i = 0; i < n; i++) {
+    tmp.mode.alpha = CLAMP(b->mode.alpha * alpha[i], 0, 0xff);
+    if (tmp.mode.alpha == 0 || scale[i] == 0) continue;
+    cmd.x = x + px[i];
+    cmd.y = y + py[i];
+    cmd.t.sx = cmd.t.sy = scale[i];
+    drawBuffer(&tmp, &cmd, &tmp.clip);
+  }
+}
+
+
+/* Draws a `w` by `h` grid of `tw` by `th` tiles of `src` at x, y. Tiles are
+ * numbered from 1 in reading order across `src`; 0 is an empty cell. As with
+ * particles, the tiles are drawn directly for the cost of a single sync and
+ * dirty rect, and each is drawn using `src`'s run index so that transparent
+ * runs are skipped and opaque ones copied */
+void sr_drawTiles(
+  sr_Buffer *b, sr_Buffer *src, int x, int y, int tw, int th,
+  int *tiles, int w, int h
+) {
+  sr_Buffer tmp;
+  int tx, ty, tx0, ty0, tx1, ty1, tile, columns, count;
+  check(tw > 0 && th > 0, "sr_drawTiles", "expected tile size greater than 0");
+  columns = src->w / tw;
+  count = columns * (src->h / th);
+  /* Get the range of cells inside the clip rect */
+  tx0 = MAX(floorDiv(b->clip.x - x, tw), 0);
+  ty0 = MAX(floorDiv(b->clip.y - y, th), 0);
+  tx1 = MIN(floorDiv(b->clip.x + b->clip.w - x + tw - 1, tw), w);
+  ty1 = MIN(floorDiv(b->clip.y + b->clip.h - y + th - 1, th), h);
+  if (count == 0 || tx0 >= tx1 || ty0 >= ty1) return;
+  sync(b);
+  sync(src);
+  /* Wrapped sources are drawn from a copy with their pixels in place */
+  if (IS_WRAPPED(src)) {
+    if (!expandBuffer(&tmp, src, sr_rect(0, 0, src->w, src->h))) return;
+    src = &tmp;
+  } else if (!SAME_PIXELS(src, b)) {
+    useRuns(src);
+  }
+  markClipped(b, sr_rect(x + tx0 * tw, y + ty0 * th,
+                         (tx1 - tx0) * tw, (ty1 - ty0) * th));
+  /* Draw */
+  for (ty = ty0; ty < ty1; ty++) {
+    for (tx = tx0; tx < tx1; tx++) {
+      tile = tiles[tx + ty * w] - 1;
+      if (tile < 0 || tile >= count) continue;
+      drawBufferBasic(b, src, x + tx * tw, y + ty * th,
+                      sr_rect((tile % columns) * tw, (tile / columns) * th,
+                              tw, th),
+                      &b->clip);
+    }
+  }
+  if (src == &tmp) {
+    free(tmp.pixels);
+  }
+}
+
+
+static void execute(sr_Buffer *b, Command *c, sr_Rect *r) {
+  switch (c->type) {
+    case CMD_CLEAR:
+      clearRegion(b, c->color, r);
+      break;
+    case CMD_RECT:
+      drawRect(b, c->color, c->rect, r);
+      break;
+    case CMD_COPY:
+      if (c->t.sx == 1 && c->t.sy == 1) {
+        /* Basic un-scaled copy */
+        copyPixelsBasic(b, c->src, c->x, c->y, c->rect, r);
+      } else if (IS_8BIT(c->src) || IS_WRAPPED(c->src)) {
+        executeExpanded(b, c, r);
+      } else if (c->t.sx == c->t.sy && c->t.sx == (int) c->t.sx) {
+        /* Scaled up by a whole number */
+        copyPixelsInteger(b, c->src, c->x, c->y, c->rect, c->t.sx, r);
+      } else {
+        /* Scaled copy */
+        copyPixelsScaled(b, c->src, c->x, c->y, c->rect, c->t.sx, c->t.sy, r);
+      }
+      break;
+    case CMD_BUFFER:
+      drawBuffer(b, c, r);
+      break;
+  }
+}
+
+
+/* Gets a conservative bounding rect of the pixels a command may write to */
+static sr_Rect getCommandBounds(sr_Buffer *b, Command *c) {
+  sr_Transform *t = &c->t;
+  float cosr, sinr, px, py;
+  float x0, y0, x1, y1;
+  int i;
+  switch (c->type) {
+    case CMD_RECT:
+      return c->rect;
+    case CMD_COPY:
+      return sr_rect(c->x, c->y, c->rect.w * t->sx + 1, c->rect.h * t->sy + 1);
+    case CMD_BUFFER:
+      cosr = (t->r == 0) ? 1 : cos(t->r);
+      sinr = (t->r == 0) ? 0 : sin(t->r);
+      x0 = y0 = 1e9;
+      x1 = y1 = -1e9;
+      for (i = 0; i < 4; i++) {
+        px = ((i & 1) ? c->rect.w : 0) - t->ox;
+        py = ((i & 2) ? c->rect.h : 0) - t->oy;
+        px *= t->sx;
+        py *= t->sy;
+        x0 = MIN(x0, c->x + cosr * px - sinr * py);
+        x1 = MAX(x1, c->x + cosr * px - sinr * py);
+        y0 = MIN(y0, c->y + sinr * px + cosr * py);
+        y1 = MAX(y1, c->y + sinr * px + cosr * py);
+      }
+      return sr_rect(x0 - 2, y0 - 2, x1 - x0 + 4, y1 - y0 + 4);
+  }
+  return sr_rect(0, 0, b->w, b->h);
+}
+
+
+typedef struct {
+  sr_Buffer *b;
+  Command *c;
+  sr_Rect region;
+  int bands;
+} Job;
+
+
+static void runBand(void *udata, int idx) {
+  Job *j = udata;
+  sr_Rect r = j->region;
+  r.y = j->region.y + j->region.h * idx / j->bands;
+  r.h = j->region.y + j->region.h * (idx + 1) / j->bands - r.y;
+  execute(j->b, j->c, &r);
+}
+
+
+static int record(sr_Buffer *b, Command *c, sr_Rect *clip, sr_Rect *bounds);
+static void useRuns(sr_Buffer *b);
+
+static void dispatch(sr_Buffer *b, Command *c) {
+  Job j;
+  sr_Rect r, bounds;
+  /* Clear ignores the clip rect, everything else is clipped to it */
+  if (c->type == CMD_CLEAR) {
+    r = sr_rect(0, 0, b->w, b->h);
+  } else {
+    r = b->clip;
+  }
+  /* Commands which can't touch any pixels are dropped */
+  bounds = getCommandBounds(b, c);
+  clipRect(&bounds, &r);
+  if (bounds.w <= 0 || bounds.h <= 0) return;
+  prepareWrite(b, bounds);
+  /* The source must be up to date before it is read */
+  if (c->src && ROOT(c->src)->commands) {
+    sync(c->src);
+  }
+  /* Buffers drawn more than once between writes get a run index */
+  if (c->type == CMD_BUFFER && !SAME_PIXELS(c->src, b) && c->t.r == 0) {
+    useRuns(c->src);
+  }
+  /* Recording? Store the command instead of drawing it */
+  if (b->commands && !SAME_PIXELS(c->src, b)) {
+    if (record(b, c, &r, &bounds)) return;
+  }
+  sync(b);
+  /* Large operations are split into horizontal bands which are processed in
+   * parallel; each band writes to its own rows only, and every operation
+   * steps its source from the same origin whatever region it is given, so
+   * the result is identical to drawing serially */
+  if (parallelFunc && parallelBands > 1 && !SAME_PIXELS(c->src, b)) {
+    if (bounds.w * bounds.h >= PARALLEL_MIN) {
+      j.b = b;
+      j.c = c;
+      j.region = r;
+      j.region.y = bounds.y;
+      j.region.h = bounds.h;
+      j.bands = MIN(parallelBands, bounds.h / PARALLEL_MIN_ROWS);
+      if (j.bands > 1) {
+        parallelFunc(runBand, &j, j.bands);
+        return;
+      }
+    }
+  }
+  execute(b, c, &r);
+}
+
+
+/* Commands recorded into a command list are binned into TILE_SIZE square
+ * tiles of the destination when flushed; each tile then executes its
+ * commands in submission order, keeping the tile in cache, and tiles are run
+ * through the parallel function if one is set. A buffer's `pending` field
+ * counts the recorded commands which use it as a source -- anything which
+ * reads or writes pixels outside of a list first calls sync() so that
+ * recorded and immediate operations always happen in program order */
+
+static void flushCommands(sr_CommandList *l);
+
+
+static void flushAll(void) {
+  sr_CommandList *l;
+  for (l = recording; l; l = l->next) {
+    flushCommands(l);
+  }
+}
+
+
+static void sync(sr_Buffer *b) {
+  b = ROOT(b);
+  if (b->commands && b->commands->count > 0) {
+    flushCommands(b->commands);
+  }
+  if (b->pending > 0) {
+    flushAll();
+  }
+}
+
+
+static int record(sr_Buffer *b, Command *c, sr_Rect *clip, sr_Rect *bounds) {
+  sr_CommandList *l = b->commands;
+  Record *rec;
+  int n;
+  /* A recorded write to a buffer other lists read from would be seen by
+   * their commands too early */
+  if (b->pending > 0) {
+    flushAll();
+  }
+  /* Grow records array */
+  if (l->count == l->capacity) {
+    n = l->capacity ? l->capacity << 1 : 256;
+    rec = realloc(l->records, n * sizeof(*rec));
+    if (!rec) return 0;
+    l->records = rec;
+    l->capacity = n;
+  }
+  rec = &l->records[l->count];
+  rec->cmd = *c;
+  rec->mode = b->mode;
+  rec->clip = *clip;
+  rec->bounds = *bounds;
+  if (c->src) {
+    ROOT(c->src)->pending++;
+    if (c->src->palette) {
+      c->src->palette->pending++;
+    }
+  }
+  l->count++;
+  return 1;
+}
+
+
+typedef struct {
+  sr_CommandList *list;
+  int tilesX;
+} TileJob;
+
+
+static void runTile(void *udata, int idx) {
+  TileJob *j = udata;
+  sr_CommandList *l = j->list;
+  sr_Buffer tmp = *l->buffer;
+  sr_Rect tile, r;
+  Record *rec;
+  int i;
+  tile = sr_rect((idx % j->tilesX) * TILE_SIZE, (idx / j->tilesX) * TILE_SIZE,
+                 TILE_SIZE, TILE_SIZE);
+  for (i = l->tiles[idx]; i < l->tiles[idx + 1]; i++) {
+    rec = &l->records[l->bins[i]];
+    /* Execute against a copy of the buffer holding the state the command was
+     * recorded with */
+    tmp.mode = rec->mode;
+    if (rec->cmd.type != CMD_CLEAR) {
+      tmp.clip = rec->clip;
+    }
+    r = tile;
+    clipRect(&r, &rec->clip);
+    execute(&tmp, &rec->cmd, &r);
+  }
+}
+
+
+static void getTileRange(sr_Rect *r, int *x0, int *y0, int *x1, int *y1) {
+  *x0 = r->x / TILE_SIZE;
+  *y0 = r->y / TILE_SIZE;
+  *x1 = (r->x + r->w - 1) / TILE_SIZE;
+  *y1 = (r->y + r->h - 1) / TILE_SIZE;
+}
+
+
+static void flushCommands(sr_CommandList *l) {
+  sr_Buffer *b = l->buffer;
+  TileJob j;
+  Record *rec;
+  int *p;
+  int i, x, y, n, total;
+  int x0, y0, x1, y1;
+  if (l->count == 0) return;
+  j.list = l;
+  j.tilesX = (b->w + TILE_SIZE - 1) / TILE_SIZE;
+  n = j.tilesX * ((b->h + TILE_SIZE - 1) / TILE_SIZE);
+  /* Count the commands touching each tile */
+  if (l->tileCapacity < n + 1) {
+    p = realloc(l->tiles, (n + 1) * sizeof(*p));
+    if (!p) goto fallback;
+    l->tiles = p;
+    l->tileCapacity = n + 1;
+  }
+  memset(l->tiles, 0, (n + 1) * sizeof(*l->tiles));
+  for (i = 0; i < l->count; i++) {
+    getTileRange(&l->records[i].bounds, &x0, &y0, &x1, &y1);
+    for (y = y0; y <= y1; y++) {
+      for (x = x0; x <= x1; x++) {
+        l->tiles[x + y * j.tilesX]++;
+      }
+    }
+  }
+  /* Turn counts into end offsets */
+  for (i = 1; i < n; i++) {
+    l->tiles[i] += l->tiles[i - 1];
+  }
+  total = l->tiles[n - 1];
+  l->tiles[n] = total;
+  if (l->binCapacity < total) {
+    p = realloc(l->bins, total * sizeof(*p));
+    if (!p) goto fallback;
+    l->bins = p;
+    l->binCapacity = total;
+  }
+  /* Fill bins back to front; this leaves each tile's offset at the start of
+   * its bin with the commands in submission order */
+  for (i = l->count - 1; i >= 0; i--) {
+    getTileRange(&l->records[i].bounds, &x0, &y0, &x1, &y1);
+    for (y = y0; y <= y1; y++) {
+      for (x = x0; x <= x1; x++) {
+        l->bins[--l->tiles[x + y * j.tilesX]] = i;
+      }
+    }
+  }
+  /* Draw tiles */
+  if (parallelFunc && parallelBands > 1 && n > 1) {
+    parallelFunc(runTile, &j, n);
+  } else {
+    for (i = 0; i < n; i++) {
+      runTile(&j, i);
+    }
+  }
+  goto done;
+fallback:
+  /* Couldn't allocate bins -- draw each command over the whole buffer */
+  for (i = 0; i < l->count; i++) {
+    Command *c = &l->records[i].cmd;
+    sr_Buffer tmp = *b;
+    tmp.mode = l->records[i].mode;
+    if (c->type != CMD_CLEAR) {
+      tmp.clip = l->records[i].clip;
+    }
+    execute(&tmp, c, &l->records[i].clip);
+  }
+done:
+  /* Release sources */
+  for (i = 0; i < l->count; i++) {
+    rec = &l->records[i];
+    if (rec->cmd.src) {
+      ROOT(rec->cmd.src)->pending--;
+      if (rec->cmd.src->palette) {
+        rec->cmd.src->palette->pending--;
+      }
+    }
+  }
+  l->count = 0;
+}
+
+
+void sr_beginCommands(sr_Buffer *b) {
+  sr_CommandList *l;
+  /* Views are always drawn to immediately, syncing their parent first */
+  if (b->commands || b->parent) return;
+  /* Recording is simply skipped if the list can't be allocated */
+  l = calloc(1, sizeof(*l));
+  if (!l) return;
+  l->buffer = b;
+  l->next = recording;
+  recording = l;
+  b->commands = l;
+}
+
+
+void sr_endCommands(sr_Buffer *b) {
+  sr_CommandList **l;
+  if (!b->commands) return;
+  flushCommands(b->commands);
+  /* Unlink and free */
+  for (l = &recording; *l != b->commands; l = &(*l)->next);
+  *l = b->commands->next;
+  free(b->commands->records);
+  free(b->commands->tiles);
+  free(b->commands->bins);
+  free(b->commands);
+  b->commands = NULL;
+}
+
+
+void sr_flushCommands(sr_Buffer *b) {
+  sync(b);
+}
+
+
+/* Dirty rects are kept as a short list of rects which are merged whenever they
+ * touch; once the list is full a new rect is merged into whichever existing
+ * rect grows the least. `last` holds the list as it was on the last call to
+ * sr_resetDirty() so that the areas drawn in the previous frame can be
+ * cleared and presented again */
+
+static sr_Rect mergeRects(sr_Rect a, sr_Rect b) {
+  int x0 = MIN(a.x, b.x);
+  int y0 = MIN(a.y, b.y);
+  int x1 = MAX(a.x + a.w, b.x + b.w);
+  int y1 = MAX(a.y + a.h, b.y + b.h);
+  return sr_rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+
+void sr_setDirtyTracking(sr_Buffer *b, int enable) {
+  if (enable && !b->dirty) {
+    b->dirty = calloc(1, sizeof(*b->dirty));
+    /* Start with everything dirty as we don't know what was drawn before */
+    sr_markDirty(b, sr_rect(0, 0, b->w, b->h));
+    sr_resetDirty(b);
+    sr_markDirty(b, sr_rect(0, 0, b->w, b->h));
+  } else if (!enable) {
+    free(b->dirty);
+    b->dirty = NULL;
+  }
+}
+
+
+/* Readies a buffer's pixels for being written to: an 8-bit buffer becomes a
+ * 32-bit one and a clone gets pixels of its own */
+static void ownPixels(sr_Buffer *b) {
+  if (IS_8BIT(b)) {
+    promote(b);
+  } else if (b->shares) {
+    unshare(b);
+  }
+}
+
+
+/* Readies the rect `r` of a buffer for being written to: the buffer gets
+ * 32-bit pixels of its own, its caches are dropped as they'd go stale, and
+ * the rect is marked dirty in the buffer and, for a view, in its parent.
+ * Every write to a buffer's pixels is preceded by a call to this */
+static void prepareWrite(sr_Buffer *b, sr_Rect r) {
+  sr_Rect full;
+  int i;
+  ownPixels(b);
+  /* Writes to a view are writes to its parent */
+  if (b->parent) {
+    i = b->pixels - b->parent->pixels;
+    full = sr_rect(0, 0, b->w, b->h);
+    clipRect(&r, &full);
+    prepareWrite(b->parent, sr_rect(r.x + i % b->stride, r.y + i / b->stride,
+                                    r.w, r.h));
+  }
+  /* Any write makes the run index, cached rotations and mipmaps stale */
+  if (b->runs) {
+    b->runs->valid = 0;
+    b->runs->uses = 0;
+  }
+  if (b->rotations) {
+    clearRotations(b);
+  }
+  if (b->mipmap) {
+    freeMipmaps(b);
+  }
+  sr_markDirty(b, r);
+}
+
+
+void sr_prepareWrite(sr_Buffer *b, sr_Rect r) {
+  sync(b);
+  prepareWrite(b, r);
+}
+
+
+void sr_markDirty(sr_Buffer *b, sr_Rect r) {
+  sr_Dirty *d = b->dirty;
+  sr_Rect full, m;
+  int i, best, area, bestArea;
+  if (!d) return;
+  full = sr_rect(0, 0, b->w, b->h);
+  clipRect(&r, &full);
+  if (r.w <= 0 || r.h <= 0) return;
+  /* Merge with every rect this touches; a merged rect is taken out of the
+   * list and the search restarted as it may now touch others */
+  i = 0;
+  while (i < d->count) {
+    m = d->rects[i];
+    if (r.x >= m.x && r.y >= m.y &&
+        r.x + r.w <= m.x + m.w && r.y + r.h <= m.y + m.h) return;
+    if (r.x <= m.x + m.w && m.x <= r.x + r.w &&
+        r.y <= m.y + m.h && m.y <= r.y + r.h) {
+      r = mergeRects(r, m);
+      d->rects[i] = d->rects[--d->count];
+      i = 0;
     } else {
-      drawBufferRotatedScaled(b, src, x, y, s, a);
+      i++;
+    }
+  }
+  /* List full? Merge with the rect which grows least */
+  if (d->count == SR_MAX_DIRTY) {
+    best = 0;
+    bestArea = INT_MAX;
+    for (i = 0; i < d->count; i++) {
+      m = mergeRects(r, d->rects[i]);
+      area = m.w * m.h - d->rects[i].w * d->rects[i].h;
+      if (area < bestArea) {
+        best = i;
+        bestArea = area;
+      }
     }
+    r = mergeRects(r, d->rects[best]);
+    d->rects[best] = d->rects[--d->count];
+  }
+  d->rects[d->count++] = r;
+}
+
+
+void sr_resetDirty(sr_Buffer *b) {
+  sr_Dirty *d = b->dirty;
+  if (!d) return;
+  memcpy(d->last, d->rects, d->count * sizeof(*d->rects));
+  d->lastCount = d->count;
+  d->count = 0;
+}
+
+
+void sr_clearDirty(sr_Buffer *b, sr_Pixel c) {
+  sr_Dirty *d = b->dirty;
+  int i;
+  /* Not tracking? We don't know what was drawn, clear everything */
+  if (!d) {
+    sr_clear(b, c);
+    return;
+  }
+  /* Clear the areas drawn to before the last reset; these aren't marked dirty
+   * again, so an area which stops being drawn to is cleared only once */
+  sync(b);
+  prepareWrite(b, sr_rect(0, 0, 0, 0));
+  if (IS_PREMUL(b)) {
+    c = sr_premultiply(c);
+  }
+  for (i = 0; i < d->lastCount; i++) {
+    clearRegion(b, c, &d->last[i]);
   }
 }
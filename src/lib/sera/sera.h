@@ -33,22 +33,58 @@ typedef struct {
 
 typedef struct {
   sr_Pixel color;
-  unsigned char alpha, blend;
+  unsigned char alpha, blend, filter;
 } sr_DrawMode;
 
 typedef struct {
   float ox, oy, r, sx, sy;
 } sr_Transform;
 
+#define SR_MAX_DIRTY (32)
+
+typedef struct {
+  sr_Rect rects[SR_MAX_DIRTY];
+  int count;
+  sr_Rect last[SR_MAX_DIRTY];
+  int lastCount;
+} sr_Dirty;
+
+typedef struct sr_CommandList sr_CommandList;
+typedef struct sr_RunIndex sr_RunIndex;
+typedef struct sr_RotationCache sr_RotationCache;
+
 typedef struct {
+  sr_Pixel colors[256];
+  int pending;
+} sr_Palette;
+
+typedef struct sr_Buffer {
   sr_DrawMode mode;
   sr_Rect clip;
   sr_Pixel *pixels;
-  int w, h;
+  unsigned char *data;
+  sr_Palette *palette;
+  int *shares;
+  int w, h, stride;
+  int ox, oy;
   char flags;
+  sr_CommandList *commands;
+  int pending;
+  sr_Dirty *dirty;
+  sr_RunIndex *runs;
+  sr_RotationCache *rotations;
+  struct sr_Buffer *mipmap, *parent;
 } sr_Buffer;
 
-#define SR_BUFFER_SHARED (1 << 0)
+typedef void (*sr_ParallelFunc)(void (*fn)(void*, int), void *udata, int n);
+
+#define SR_BUFFER_SHARED  (1 << 0)
+#define SR_BUFFER_OPAQUE  (1 << 1)
+#define SR_BUFFER_PREMUL  (1 << 2)
+#define SR_BUFFER_A8      (1 << 3)
+#define SR_BUFFER_INDEXED (1 << 4)
+#define SR_BUFFER_VIEWED  (1 << 5)
+#define SR_BUFFER_WRAP    (1 << 6)
 
 enum {
   SR_FMT_BGRA,
@@ -69,41 +105,87 @@ enum {
   SR_BLEND_DIFFERENCE
 };
 
+enum {
+  SR_FILTER_NEAREST,
+  SR_FILTER_LINEAR
+};
+
 
 sr_Pixel sr_pixel(int r, int g, int b, int a);
 sr_Pixel sr_color(int r, int g, int b);
 sr_Transform sr_transform(void);
 sr_Rect sr_rect(int x, int y, int w, int h);
+sr_Pixel sr_premultiply(sr_Pixel c);
+sr_Pixel sr_unpremultiply(sr_Pixel c);
+
+void sr_setParallel(sr_ParallelFunc fn, int bands);
+void sr_setRotationCacheBudget(int bytes);
+void sr_setRowPadding(int enable);
+void sr_setSimd(int enable);
 
 sr_Buffer *sr_newBuffer(int w, int h);
 sr_Buffer *sr_newBufferShared(void *pixels, int w, int h);
+sr_Buffer *sr_newBufferA8(int w, int h);
+sr_Buffer *sr_newBufferIndexed(int w, int h, sr_Palette *pal);
+sr_Buffer *sr_newBufferView(sr_Buffer *parent, sr_Rect r);
 sr_Buffer *sr_cloneBuffer(sr_Buffer *src);
 void sr_destroyBuffer(sr_Buffer* b);
 
 void sr_loadPixels(sr_Buffer *b, void *src, int fmt);
 void sr_loadPixels8(sr_Buffer *b, unsigned char *src, sr_Pixel *pal);
+void sr_setPremultiplied(sr_Buffer *b, int enable);
+int sr_isPremultiplied(sr_Buffer *b);
+void sr_setWrap(sr_Buffer *b, int enable);
+void sr_setPalette(sr_Buffer *b, sr_Palette *pal);
+void sr_setPaletteColors(sr_Palette *pal, sr_Pixel *colors, int idx, int n);
+void sr_setRotationCache(sr_Buffer *b, int steps);
+void sr_generateMipmaps(sr_Buffer *b);
 
 void sr_setAlpha(sr_Buffer* b, int alpha);
 void sr_setBlend(sr_Buffer* b, int blend);
 void sr_setColor(sr_Buffer* b, sr_Pixel c);
+void sr_setFilter(sr_Buffer* b, int filter);
 void sr_setClip(sr_Buffer *b, sr_Rect r);
 void sr_reset(sr_Buffer *b);
 
+void sr_beginCommands(sr_Buffer *b);
+void sr_endCommands(sr_Buffer *b);
+void sr_flushCommands(sr_Buffer *b);
+
+void sr_setDirtyTracking(sr_Buffer *b, int enable);
+void sr_prepareWrite(sr_Buffer *b, sr_Rect r);
+void sr_markDirty(sr_Buffer *b, sr_Rect r);
+void sr_resetDirty(sr_Buffer *b);
+void sr_clearDirty(sr_Buffer *b, sr_Pixel c);
+
 void sr_clear(sr_Buffer *b, sr_Pixel c);
 sr_Pixel sr_getPixel(sr_Buffer *b, int x, int y);
 void sr_setPixel(sr_Buffer *b, sr_Pixel c, int x, int y);
 void sr_copyPixels(sr_Buffer *b, sr_Buffer *src, int x, int y,
                    sr_Rect *sub, float sx, float sy);
+void sr_scroll(sr_Buffer *b, int dx, int dy);
 void sr_noise(sr_Buffer *b, unsigned seed, int low, int high, int grey);
-void sr_floodFill(sr_Buffer *b, sr_Pixel c, int x, int y);
+int sr_floodFill(sr_Buffer *b, sr_Pixel c, int x, int y,
+                 int tolerance, int diagonal);
 
 void sr_drawPixel(sr_Buffer *b, sr_Pixel c, int x, int y);
 void sr_drawLine(sr_Buffer *b, sr_Pixel c, int x0, int y0, int x1, int y1);
+void sr_drawPolyline(sr_Buffer *b, sr_Pixel c, int *points, int n);
 void sr_drawRect(sr_Buffer *b, sr_Pixel c, int x, int y, int w, int h);
 void sr_drawBox(sr_Buffer *b, sr_Pixel c, int x, int y, int w, int h);
 void sr_drawCircle(sr_Buffer *b, sr_Pixel c, int x, int y, int r);
 void sr_drawRing(sr_Buffer *b, sr_Pixel c, int x, int y, int r);
+void sr_drawPixels(sr_Buffer *b, sr_Pixel *c, int *xy, int n);
+void sr_drawLines(sr_Buffer *b, sr_Pixel *c, int *lines, int n);
+void sr_drawRects(sr_Buffer *b, sr_Pixel *c, int *rects, int n);
+void sr_drawCircles(sr_Buffer *b, sr_Pixel *c, int *circles, int n);
 void sr_drawBuffer(sr_Buffer *b, sr_Buffer *src, int x, int y,
                    sr_Rect *sub, sr_Transform *t);
+void sr_drawTriangles(sr_Buffer *b, sr_Buffer *src, float *xy, float *uv,
+                      int *indices, int n);
+void sr_drawParticles(sr_Buffer *b, sr_Buffer *src, int x, int y,
+                      float *px, float *py, float *scale, float *alpha, int n);
+void sr_drawTiles(sr_Buffer *b, sr_Buffer *src, int x, int y, int tw, int th,
+                  int *tiles, int w, int h);
 
 #endif
@@ -0,0 +1,205 @@
+/** 
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "util.h"
+#include "luax.h"
+#include "m_buffer.h"
+#include "m_quad.h"
+
+#define CLASS_NAME "Atlas"
+
+/* Buffers are packed with a skyline packer: the skyline is a list of nodes,
+ * each a horizontal segment of the atlas' top edge of used space, sorted
+ * left to right. A new rect is placed on the node where its bottom edge ends
+ * up lowest, and the nodes it covers are cut back or removed */
+
+typedef struct { int x, y, w; } Node;
+
+typedef struct {
+  sr_Buffer *buffer;
+  int bufferRef;
+  int padding;
+  Node *nodes;
+  int count, capacity;
+} Atlas;
+
+
+static int insertNode(Atlas *self, int idx, Node n) {
+  if (self->count == self->capacity) {
+    int capacity = self->capacity ? self->capacity << 1 : 16;
+    Node *nodes = realloc(self->nodes, capacity * sizeof(*nodes));
+    if (!nodes) return -1;
+    self->nodes = nodes;
+    self->capacity = capacity;
+  }
+  memmove(self->nodes + idx + 1, self->nodes + idx,
+          (self->count - idx) * sizeof(*self->nodes));
+  self->nodes[idx] = n;
+  self->count++;
+  return 0;
+}
+
+
+static void removeNode(Atlas *self, int idx) {
+  memmove(self->nodes + idx, self->nodes + idx + 1,
+          (self->count - idx - 1) * sizeof(*self->nodes));
+  self->count--;
+}
+
+
+/* Gets the y position a padded rect placed at node `idx` would have, or -1
+ * if it doesn't fit there. Padding only separates rects, so it may hang off
+ * the atlas' right and bottom edges */
+static int fitNode(Atlas *self, int idx, int w, int h) {
+  int x = self->nodes[idx].x;
+  int y = 0;
+  if (x + w - self->padding > self->buffer->w) return -1;
+  w = MIN(w, self->buffer->w - x);
+  while (w > 0) {
+    y = MAX(y, self->nodes[idx].y);
+    if (y + h - self->padding > self->buffer->h) return -1;
+    w -= self->nodes[idx].w;
+    idx++;
+  }
+  return y;
+}
+
+
+static int pack(Atlas *self, int w, int h, sr_Rect *r) {
+  int i, y, best = -1, bestY = INT_MAX, bestW = INT_MAX;
+  Node n, *p;
+  /* Find node where the rect's bottom is lowest, ties go to the narrowest */
+  for (i = 0; i < self->count; i++) {
+    y = fitNode(self, i, w, h);
+    if (y < 0) continue;
+    if (y + h < bestY || (y + h == bestY && self->nodes[i].w < bestW)) {
+      best = i;
+      bestY = y + h;
+      bestW = self->nodes[i].w;
+    }
+  }
+  if (best < 0) return -1;
+  /* Add node for the top of the rect, without any padding past the edges */
+  n.x = self->nodes[best].x;
+  n.y = MIN(bestY, self->buffer->h);
+  n.w = MIN(w, self->buffer->w - n.x);
+  if (insertNode(self, best, n) < 0) return -1;
+  *r = sr_rect(n.x, bestY - h, w, h);
+  /* Cut back the nodes now under it */
+  i = best + 1;
+  while (i < self->count) {
+    p = &self->nodes[i];
+    if (p->x >= n.x + n.w) break;
+    if (p->x + p->w <= n.x + n.w) {
+      removeNode(self, i);
+      continue;
+    }
+    p->w -= n.x + n.w - p->x;
+    p->x = n.x + n.w;
+    break;
+  }
+  /* Merge neighbouring nodes of the same height */
+  i = 0;
+  while (i < self->count - 1) {
+    if (self->nodes[i].y == self->nodes[i + 1].y) {
+      self->nodes[i].w += self->nodes[i + 1].w;
+      removeNode(self, i + 1);
+    } else {
+      i++;
+    }
+  }
+  return 0;
+}
+
+
+static int l_atlas_new(lua_State *L) {
+  int w = luaL_checknumber(L, 1);
+  int h = luaL_checknumber(L, 2);
+  int padding = luaL_optnumber(L, 3, 0);
+  Node n;
+  if (w <= 0) luaL_argerror(L, 1, "expected width greater than 0");
+  if (h <= 0) luaL_argerror(L, 2, "expected height greater than 0");
+  if (padding < 0) luaL_argerror(L, 3, "expected padding of 0 or greater");
+  Atlas *self = lua_newuserdata(L, sizeof(*self));
+  luaL_setmetatable(L, CLASS_NAME);
+  memset(self, 0, sizeof(*self));
+  self->bufferRef = LUA_NOREF;
+  self->padding = padding;
+  /* Init buffer */
+  Buffer *b = buffer_new(L);
+  b->buffer = sr_newBuffer(w, h);
+  if (!b->buffer) {
+    luaL_error(L, "could not create buffer");
+  }
+  sr_clear(b->buffer, sr_pixel(0, 0, 0, 0));
+  self->buffer = b->buffer;
+  self->bufferRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  /* Init skyline */
+  n.x = n.y = 0;
+  n.w = w;
+  if (insertNode(self, 0, n) < 0) {
+    luaL_error(L, "out of memory");
+  }
+  return 1;
+}
+
+
+static int l_atlas_gc(lua_State *L) {
+  Atlas *self = luaL_checkudata(L, 1, CLASS_NAME);
+  free(self->nodes);
+  luaL_unref(L, LUA_REGISTRYINDEX, self->bufferRef);
+  return 0;
+}
+
+
+static int l_atlas_add(lua_State *L) {
+  Atlas *self = luaL_checkudata(L, 1, CLASS_NAME);
+  Buffer *src = luaL_checkudata(L, 2, BUFFER_CLASS_NAME);
+  sr_Rect r;
+  int w = src->buffer->w + self->padding;
+  int h = src->buffer->h + self->padding;
+  /* No room left? Return nil so the caller can start a new atlas */
+  if (pack(self, w, h, &r) < 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  r.w = src->buffer->w;
+  r.h = src->buffer->h;
+  sr_copyPixels(self->buffer, src->buffer, r.x, r.y, NULL, 1, 1);
+  /* Push quad of the atlas buffer */
+  lua_rawgeti(L, LUA_REGISTRYINDEX, self->bufferRef);
+  quad_new(L, -1, r);
+  return 1;
+}
+
+
+static int l_atlas_getBuffer(lua_State *L) {
+  Atlas *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, self->bufferRef);
+  return 1;
+}
+
+
+int luaopen_atlas(lua_State *L) {
+  luaL_Reg reg[] = {
+    { "__gc",         l_atlas_gc          },
+    { "new",          l_atlas_new         },
+    { "add",          l_atlas_add         },
+    { "getBuffer",    l_atlas_getBuffer   },
+    { NULL, NULL }
+  };
+  ASSERT( luaL_newmetatable(L, CLASS_NAME) );
+  luaL_setfuncs(L, reg, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
@@ -10,10 +10,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "lib/stb_image.h"
 #include "lib/sera/sera.h"
 #include "m_buffer.h"
+#include "m_data.h"
+#include "m_quad.h"
+#include "m_palette.h"
 #include "util.h"
 #include "fs.h"
 
@@ -23,6 +27,8 @@ Buffer *buffer_new(lua_State *L) {
   Buffer *self = lua_newuserdata(L, sizeof(*self));
   luaL_setmetatable(L, CLASS_NAME);
   memset(self, 0, sizeof(*self));
+  self->parentRef = LUA_NOREF;
+  self->paletteRef = LUA_NOREF;
   return self;
 }
 
@@ -58,7 +64,29 @@ static void checkSubRect(lua_State *L, int idx, sr_Buffer *b, sr_Rect *r) {
 }
 
 
-static int loadBufferFromMemory(Buffer *self, const void *data, int len) {
+/* Gets the optional sub rect argument of `b` at `idx`, either a Quad of `b`,
+ * which was checked when it was created, or a table; returns 0 if there is
+ * none */
+static int getSubArg(lua_State *L, int idx, sr_Buffer *b, sr_Rect *r) {
+  Quad *q;
+  if (lua_isnoneornil(L, idx)) return 0;
+  q = luaL_testudata(L, idx, QUAD_CLASS_NAME);
+  if (q) {
+    if (q->buffer != b) {
+      luaL_argerror(L, idx, "quad is not of the source buffer");
+    }
+    *r = q->rect;
+    return 1;
+  }
+  *r = getRectArg(L, idx);
+  checkSubRect(L, idx, b, r);
+  return 1;
+}
+
+
+static int loadBufferFromMemory(
+  Buffer *self, const void *data, int len, int premul
+) {
   int w, h;
   void *pixels = stbi_load_from_memory(
     data, len, &w, &h, NULL, STBI_rgb_alpha);
@@ -70,6 +98,10 @@ static int loadBufferFromMemory(Buffer *self, const void *data, int len) {
     free(pixels);
     return -1;
   }
+  /* Premultiplied buffers are converted as the pixels are loaded */
+  if (premul) {
+    self->buffer->flags |= SR_BUFFER_PREMUL;
+  }
   sr_loadPixels(self->buffer, pixels, SR_FMT_RGBA);
   free(pixels);
   return 0;
@@ -78,13 +110,14 @@ static int loadBufferFromMemory(Buffer *self, const void *data, int len) {
 
 static int l_buffer_fromFile(lua_State *L) {
   const char *filename = luaL_checkstring(L, 1);
+  int premul = luax_optboolean(L, 2, 0);
   Buffer *self = buffer_new(L);
   size_t len;
   void *data = fs_read(filename, &len);
   if (!data) {
     luaL_error(L, "could not open file '%s'", filename);
   }
-  int err = loadBufferFromMemory(self, data, len);
+  int err = loadBufferFromMemory(self, data, len, premul);
   free(data);
   if (err) {
     luaL_error(L, "could not load buffer");
@@ -96,8 +129,9 @@ static int l_buffer_fromFile(lua_State *L) {
 static int l_buffer_fromString(lua_State *L) {
   size_t len;
   const char *str = luaL_checklstring(L, 1, &len);
+  int premul = luax_optboolean(L, 2, 0);
   Buffer *self = buffer_new(L);
-  int err = loadBufferFromMemory(self, str, len);
+  int err = loadBufferFromMemory(self, str, len, premul);
   if (err) {
     luaL_error(L, "could not load buffer");
   }
@@ -120,6 +154,63 @@ static int l_buffer_fromBlank(lua_State *L) {
 }
 
 
+/* Gets the index of the color of `pal` nearest to `c` */
+static int nearestColor(sr_Palette *pal, sr_Pixel c) {
+  int i, d, best = 0, bestDist = INT_MAX;
+  sr_Pixel *p;
+  for (i = 0; i < 256; i++) {
+    p = &pal->colors[i];
+    d = (p->rgba.r - c.rgba.r) * (p->rgba.r - c.rgba.r) +
+        (p->rgba.g - c.rgba.g) * (p->rgba.g - c.rgba.g) +
+        (p->rgba.b - c.rgba.b) * (p->rgba.b - c.rgba.b) +
+        (p->rgba.a - c.rgba.a) * (p->rgba.a - c.rgba.a);
+    if (d < bestDist) {
+      if (d == 0) return i;
+      best = i;
+      bestDist = d;
+    }
+  }
+  return best;
+}
+
+
+static int l_buffer_fromIndexed(lua_State *L) {
+  sr_Buffer *src = ((Buffer*) luaL_checkudata(L, 1, CLASS_NAME))->buffer;
+  Palette *pal = luaL_checkudata(L, 2, PALETTE_CLASS_NAME);
+  unsigned char *idx;
+  sr_Pixel px, last;
+  int x, y, i = 0;
+  Buffer *self = buffer_new(L);
+  self->buffer = sr_newBufferIndexed(src->w, src->h, &pal->palette);
+  if (!self->buffer) {
+    luaL_error(L, "could not create buffer");
+  }
+  /* The buffer draws through the palette so must keep it alive */
+  lua_pushvalue(L, 2);
+  self->paletteRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  /* Convert each pixel to the index of its nearest palette color */
+  idx = malloc(src->w * src->h);
+  if (!idx) {
+    luaL_error(L, "out of memory");
+  }
+  last = sr_getPixel(src, 0, 0);
+  i = nearestColor(&pal->palette, last);
+  for (y = 0; y < src->h; y++) {
+    for (x = 0; x < src->w; x++) {
+      px = sr_getPixel(src, x, y);
+      if (px.word != last.word) {
+        i = nearestColor(&pal->palette, px);
+        last = px;
+      }
+      idx[x + y * src->w] = i;
+    }
+  }
+  sr_loadPixels8(self->buffer, idx, NULL);
+  free(idx);
+  return 1;
+}
+
+
 static int l_buffer_clone(lua_State *L) {
   Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
   Buffer *b = buffer_new(L);
@@ -127,6 +218,33 @@ static int l_buffer_clone(lua_State *L) {
   if (!b->buffer) {
     luaL_error(L, "could not clone buffer");
   }
+  /* A clone of an indexed buffer shares its palette */
+  if (b->buffer->palette) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, self->paletteRef);
+    b->paletteRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  return 1;
+}
+
+
+static int l_buffer_view(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  int x = luaL_checknumber(L, 2);
+  int y = luaL_checknumber(L, 3);
+  int w = luaL_checknumber(L, 4);
+  int h = luaL_checknumber(L, 5);
+  sr_Rect r = sr_rect(x, y, w, h);
+  if (w <= 0) luaL_argerror(L, 4, "expected width greater than 0");
+  if (h <= 0) luaL_argerror(L, 5, "expected height greater than 0");
+  checkSubRect(L, 2, self->buffer, &r);
+  Buffer *b = buffer_new(L);
+  b->buffer = sr_newBufferView(self->buffer, r);
+  if (!b->buffer) {
+    luaL_error(L, "could not create view");
+  }
+  /* The view shares the parent's pixels so must keep it alive */
+  lua_pushvalue(L, 1);
+  b->parentRef = luaL_ref(L, LUA_REGISTRYINDEX);
   return 1;
 }
 
@@ -136,6 +254,8 @@ static int l_buffer_gc(lua_State *L) {
   if (self->buffer) {               /* self->buffer may be NULL if  */
     sr_destroyBuffer(self->buffer); /* an error was raised in the   */
   }                                 /* constructor                  */
+  luaL_unref(L, LUA_REGISTRYINDEX, self->parentRef);
+  luaL_unref(L, LUA_REGISTRYINDEX, self->paletteRef);
   return 0;
 }
 
@@ -186,6 +306,81 @@ static int l_buffer_setColor(lua_State *L) {
 }
 
 
+static int l_buffer_setFilter(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  const char *str = luaL_optstring(L, 2, "nearest");
+  int filter = 0;
+  if      (!strcmp(str, "nearest")) filter = SR_FILTER_NEAREST;
+  else if (!strcmp(str, "linear" )) filter = SR_FILTER_LINEAR;
+  else luaL_argerror(L, 2, "bad filter mode");
+  sr_setFilter(self->buffer, filter);
+  return 0;
+}
+
+
+static int l_buffer_setPremultiplied(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_setPremultiplied(self->buffer, luax_optboolean(L, 2, 1));
+  return 0;
+}
+
+
+static int l_buffer_setWrap(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_setWrap(self->buffer, luax_optboolean(L, 2, 1));
+  return 0;
+}
+
+
+static int l_buffer_getOrigin(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_pushnumber(L, self->buffer->ox);
+  lua_pushnumber(L, self->buffer->oy);
+  return 2;
+}
+
+
+static int l_buffer_setPalette(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  Palette *pal = luaL_checkudata(L, 2, PALETTE_CLASS_NAME);
+  if (~self->buffer->flags & SR_BUFFER_INDEXED) {
+    luaL_error(L, "expected indexed buffer");
+  }
+  sr_setPalette(self->buffer, &pal->palette);
+  luaL_unref(L, LUA_REGISTRYINDEX, self->paletteRef);
+  lua_pushvalue(L, 2);
+  self->paletteRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+
+static int l_buffer_getPalette(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  if (~self->buffer->flags & SR_BUFFER_INDEXED) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, self->paletteRef);
+  return 1;
+}
+
+
+static int l_buffer_cacheRotations(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  int steps = luaL_optnumber(L, 2, 0);
+  if (steps < 0) luaL_argerror(L, 2, "expected steps of 0 or greater");
+  sr_setRotationCache(self->buffer, steps);
+  return 0;
+}
+
+
+static int l_buffer_generateMipmaps(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_generateMipmaps(self->buffer);
+  return 0;
+}
+
+
 static int l_buffer_setClip(lua_State *L) {
   Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
   int x = luaL_checkinteger(L, 2);
@@ -204,6 +399,27 @@ static int l_buffer_reset(lua_State *L) {
 }
 
 
+static int l_buffer_beginCommands(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_beginCommands(self->buffer);
+  return 0;
+}
+
+
+static int l_buffer_endCommands(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_endCommands(self->buffer);
+  return 0;
+}
+
+
+static int l_buffer_flushCommands(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_flushCommands(self->buffer);
+  return 0;
+}
+
+
 static int l_buffer_clear(lua_State *L) {
   Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
   sr_clear(self->buffer, getColorArgs(L, 2, 1));
@@ -211,6 +427,13 @@ static int l_buffer_clear(lua_State *L) {
 }
 
 
+static int l_buffer_clearDirty(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_clearDirty(self->buffer, getColorArgs(L, 2, 1));
+  return 0;
+}
+
+
 static int l_buffer_getPixel(lua_State *L) {
   Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
   int x = luaL_checknumber(L, 2);
@@ -239,12 +462,7 @@ static int l_buffer_copyPixels(lua_State *L) {
   Buffer *src  = luaL_checkudata(L, 2, CLASS_NAME);
   int x = luaL_optnumber(L, 3, 0);
   int y = luaL_optnumber(L, 4, 0);
-  int hasSub = 0;
-  if (!lua_isnoneornil(L, 5)) {
-    hasSub = 1;
-    sub = getRectArg(L, 5);
-    checkSubRect(L, 5, src->buffer, &sub);
-  }
+  int hasSub = getSubArg(L, 5, src->buffer, &sub);
   float sx = luaL_optnumber(L, 6, 1.);
   float sy = luaL_optnumber(L, 7, sx);
   sr_copyPixels(self->buffer, src->buffer, x, y,
@@ -253,6 +471,15 @@ static int l_buffer_copyPixels(lua_State *L) {
 }
 
 
+static int l_buffer_scroll(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  int dx = luaL_optnumber(L, 2, 0);
+  int dy = luaL_optnumber(L, 3, 0);
+  sr_scroll(self->buffer, dx, dy);
+  return 0;
+}
+
+
 static int l_buffer_noise(lua_State *L) {
   Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
   int seed = luaL_optnumber(L, 2, rand());
@@ -264,12 +491,19 @@ static int l_buffer_noise(lua_State *L) {
 }
 
 
+/* The fill only spreads up, down and sideways unless `diagonal` is true.
+ * Fills used to also reach some diagonal pixels at the ends of each run, so
+ * code relying on that should pass `diagonal` */
 static int l_buffer_floodFill(lua_State *L) {
   Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
   int x = luaL_checknumber(L, 2);
   int y = luaL_checknumber(L, 3);
   sr_Pixel px = getColorArgs(L, 4, 0);
-  sr_floodFill(self->buffer, px, x, y);
+  int tolerance = luaL_optnumber(L, 8, 0) * 0xff;
+  int diagonal = luax_optboolean(L, 9, 0);
+  if (!sr_floodFill(self->buffer, px, x, y, tolerance, diagonal)) {
+    luaL_error(L, "could not allocate flood fill");
+  }
   return 0;
 }
 
@@ -330,25 +564,200 @@ static int l_buffer_drawCircle(lua_State *L) {
 }
 
 
+/* Gets the number at index `i` of the table at `idx`, which holds records
+ * of `fields` numbers each, raising an error naming the record if it isn't
+ * a number */
+static lua_Number getRecordNumber(lua_State *L, int idx, int i, int fields) {
+  lua_Number n;
+  lua_rawgeti(L, idx, i);
+  if (!lua_isnumber(L, -1)) {
+    luaL_argerror(L, idx, lua_pushfstring(L,
+      "expected number at index %d, record %d", i, (i - 1) / fields + 1));
+  }
+  n = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  return n;
+}
+
+
+/* The batch draw functions take either a flat table of numbers, with the
+ * color of all the primitives given after it, or a string or Data of packed
+ * records, each a 32bit int per field followed by the color's r, g, b and a
+ * bytes. Either is unpacked into an array of fields and one of colors and
+ * drawn with a single sera call */
+
+typedef void (*PrimitiveFunc)(sr_Buffer *b, sr_Pixel *c, int *f, int n);
+
+static void drawPrimitives(lua_State *L, int fields, PrimitiveFunc fn) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_Pixel *colors;
+  int *f;
+  int i, n;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    sr_Pixel px = getColorArgs(L, 3, 0);
+    n = lua_rawlen(L, 2);
+    if (n % fields != 0) {
+      luaL_argerror(L, 2, "bad number of values");
+    }
+    f = lua_newuserdata(L, n * sizeof(*f));
+    for (i = 0; i < n; i++) {
+      f[i] = getRecordNumber(L, 2, i + 1, fields);
+    }
+    n /= fields;
+    colors = lua_newuserdata(L, n * sizeof(*colors));
+    for (i = 0; i < n; i++) {
+      colors[i] = px;
+    }
+  } else {
+    const unsigned char *p;
+    size_t len;
+    int size = fields * 4 + 4;
+    if (lua_type(L, 2) == LUA_TSTRING) {
+      p = (const unsigned char*) lua_tolstring(L, 2, &len);
+    } else {
+      Data *data = luaL_checkudata(L, 2, DATA_CLASS_NAME);
+      p = data->data;
+      len = data->len;
+    }
+    if (len % size != 0) {
+      luaL_argerror(L, 2, "bad record data length");
+    }
+    n = len / size;
+    f = lua_newuserdata(L, n * fields * sizeof(*f));
+    colors = lua_newuserdata(L, n * sizeof(*colors));
+    for (i = 0; i < n; i++, p += size) {
+      const unsigned char *c = p + fields * 4;
+      memcpy(f + i * fields, p, fields * 4);
+      colors[i] = sr_pixel(c[0], c[1], c[2], c[3]);
+    }
+  }
+  fn(self->buffer, colors, f, n);
+}
+
+
+static int l_buffer_drawPixels(lua_State *L) {
+  drawPrimitives(L, 2, sr_drawPixels);
+  return 0;
+}
+
+
+static int l_buffer_drawLines(lua_State *L) {
+  drawPrimitives(L, 4, sr_drawLines);
+  return 0;
+}
+
+
+static int l_buffer_drawPolyline(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  int i, n, *points;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  sr_Pixel px = getColorArgs(L, 3, 0);
+  n = lua_rawlen(L, 2);
+  if (n % 2 != 0) {
+    luaL_argerror(L, 2, "bad number of values");
+  }
+  points = lua_newuserdata(L, n * sizeof(*points));
+  for (i = 0; i < n; i++) {
+    points[i] = getRecordNumber(L, 2, i + 1, 2);
+  }
+  sr_drawPolyline(self->buffer, px, points, n / 2);
+  return 0;
+}
+
+
+static int l_buffer_drawRects(lua_State *L) {
+  drawPrimitives(L, 4, sr_drawRects);
+  return 0;
+}
+
+
+static int l_buffer_drawCircles(lua_State *L) {
+  drawPrimitives(L, 3, sr_drawCircles);
+  return 0;
+}
+
+
 static int l_buffer_drawBuffer(lua_State *L) {
   int hasSub = 0;
   sr_Rect sub;
   sr_Transform t;
+  sr_Buffer *src;
   Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
-  Buffer *src  = luaL_checkudata(L, 2, CLASS_NAME);
+  Quad *quad = luaL_testudata(L, 2, QUAD_CLASS_NAME);
   int x = luaL_optnumber(L, 3, 0);
   int y = luaL_optnumber(L, 4, 0);
-  if (!lua_isnoneornil(L, 5)) {
+  if (quad) {
+    /* Quads draw from their buffer; a sub rect is relative to the quad */
+    src = quad->buffer;
     hasSub = 1;
-    sub = getRectArg(L, 5);
-    checkSubRect(L, 5, src->buffer, &sub);
+    sub = quad->rect;
+    if (!lua_isnoneornil(L, 5)) {
+      sub = getRectArg(L, 5);
+      if (sub.x < 0 || sub.y < 0 ||
+          sub.x + sub.w > quad->rect.w || sub.y + sub.h > quad->rect.h
+      ) {
+        luaL_argerror(L, 5, "sub rectangle out of bounds");
+      }
+      sub.x += quad->rect.x;
+      sub.y += quad->rect.y;
+    }
+  } else {
+    src = ((Buffer*) luaL_checkudata(L, 2, CLASS_NAME))->buffer;
+    hasSub = getSubArg(L, 5, src, &sub);
   }
   t.r  = luaL_optnumber(L, 6, 0);
   t.sx = luaL_optnumber(L, 7, 1);
   t.sy = luaL_optnumber(L, 8, t.sx);
   t.ox = luaL_optnumber(L, 9, 0);
   t.oy = luaL_optnumber(L, 10, 0);
-  sr_drawBuffer(self->buffer, src->buffer, x, y, hasSub ? &sub : NULL, &t);
+  sr_drawBuffer(self->buffer, src, x, y, hasSub ? &sub : NULL, &t);
+  return 0;
+}
+
+
+static int l_buffer_drawMesh(lua_State *L) {
+  Buffer *self = luaL_checkudata(L, 1, CLASS_NAME);
+  Buffer *src = luaL_checkudata(L, 2, CLASS_NAME);
+  int i, n, count, *indices = NULL;
+  int hasIndices = !lua_isnoneornil(L, 4);
+  float *xy, *uv;
+  luaL_checktype(L, 3, LUA_TTABLE);
+  if (hasIndices) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+  }
+  /* Vertices are a flat table of x, y, u, v values */
+  n = lua_rawlen(L, 3);
+  if (n % 4 != 0) {
+    luaL_argerror(L, 3, "bad number of values");
+  }
+  n /= 4;
+  xy = lua_newuserdata(L, n * 2 * sizeof(*xy));
+  uv = lua_newuserdata(L, n * 2 * sizeof(*uv));
+  for (i = 0; i < n * 4; i++) {
+    if (i % 4 < 2) {
+      xy[(i / 4) * 2 + i % 4] = getRecordNumber(L, 3, i + 1, 4);
+    } else {
+      uv[(i / 4) * 2 + i % 4 - 2] = getRecordNumber(L, 3, i + 1, 4);
+    }
+  }
+  /* Without indices each 3 vertices are a triangle */
+  if (!hasIndices) {
+    count = n / 3;
+  } else {
+    count = lua_rawlen(L, 4);
+    if (count % 3 != 0) {
+      luaL_argerror(L, 4, "bad number of indices");
+    }
+    indices = lua_newuserdata(L, count * sizeof(*indices));
+    for (i = 0; i < count; i++) {
+      indices[i] = getRecordNumber(L, 4, i + 1, 3) - 1;
+      if (indices[i] < 0 || indices[i] >= n) {
+        luaL_argerror(L, 4, "index out of bounds");
+      }
+    }
+    count /= 3;
+  }
+  sr_drawTriangles(self->buffer, src->buffer, xy, uv, indices, count);
   return 0;
 }
 
@@ -359,18 +768,33 @@ int luaopen_buffer(lua_State *L) {
     { "fromFile",       l_buffer_fromFile       },
     { "fromString",     l_buffer_fromString     },
     { "fromBlank",      l_buffer_fromBlank      },
+    { "fromIndexed",    l_buffer_fromIndexed    },
     { "clone",          l_buffer_clone          },
+    { "view",           l_buffer_view           },
     { "getWidth",       l_buffer_getWidth       },
     { "getHeight",      l_buffer_getHeight      },
     { "setAlpha",       l_buffer_setAlpha       },
     { "setBlend",       l_buffer_setBlend       },
     { "setColor",       l_buffer_setColor       },
+    { "setFilter",      l_buffer_setFilter      },
     { "setClip",        l_buffer_setClip        },
+    { "setPremultiplied", l_buffer_setPremultiplied },
+    { "setWrap",        l_buffer_setWrap        },
+    { "getOrigin",      l_buffer_getOrigin      },
+    { "setPalette",     l_buffer_setPalette     },
+    { "getPalette",     l_buffer_getPalette     },
+    { "cacheRotations",   l_buffer_cacheRotations  },
+    { "generateMipmaps",  l_buffer_generateMipmaps },
     { "reset",          l_buffer_reset          },
+    { "beginCommands",  l_buffer_beginCommands  },
+    { "endCommands",    l_buffer_endCommands    },
+    { "flushCommands",  l_buffer_flushCommands  },
     { "clear",          l_buffer_clear          },
+    { "clearDirty",     l_buffer_clearDirty     },
     { "getPixel",       l_buffer_getPixel       },
     { "setPixel",       l_buffer_setPixel       },
     { "copyPixels",     l_buffer_copyPixels     },
+    { "scroll",         l_buffer_scroll         },
     { "noise",          l_buffer_noise          },
     { "floodFill",      l_buffer_floodFill      },
     { "drawPixel",      l_buffer_drawPixel      },
@@ -378,8 +802,14 @@ int luaopen_buffer(lua_State *L) {
     { "drawRect",       l_buffer_drawRect       },
     { "drawBox",        l_buffer_drawBox        },
     { "drawCircle",     l_buffer_drawCircle     },
+    { "drawPixels",     l_buffer_drawPixels     },
+    { "drawLines",      l_buffer_drawLines      },
+    { "drawPolyline",   l_buffer_drawPolyline   },
+    { "drawRects",      l_buffer_drawRects      },
+    { "drawCircles",    l_buffer_drawCircles    },
     { "drawBuffer",     l_buffer_drawBuffer     },
     { "draw",           l_buffer_drawBuffer     },
+    { "drawMesh",       l_buffer_drawMesh       },
     { NULL, NULL }
   };
   ASSERT( luaL_newmetatable(L, CLASS_NAME) );
@@ -16,6 +16,8 @@
 
 typedef struct {
   sr_Buffer *buffer;
+  int parentRef;
+  int paletteRef;
 } Buffer;
 
 Buffer *buffer_new(lua_State *L);
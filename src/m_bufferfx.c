@@ -62,35 +62,50 @@ static sr_Pixel getColorFromTable(lua_State *L, int idx) {
   return px;
 }
 
+/* Readies a buffer's pixels for being written to directly */
+static void touchBuffer(Buffer *b) {
+  sr_prepareWrite(b->buffer, sr_rect(0, 0, b->buffer->w, b->buffer->h));
+}
+
 static void checkBufferSizesMatch(lua_State *L, Buffer *a, Buffer *b) {
   if (a->buffer->w != b->buffer->w || a->buffer->h != b->buffer->h) {
     luaL_error(L, "expected buffer sizes to match");
   }
 }
 
+/* Source buffers whose pixels are read directly can't be 8-bit */
+static void checkPixels(lua_State *L, int idx, Buffer *b) {
+  if (b->buffer->flags & (SR_BUFFER_A8 | SR_BUFFER_INDEXED)) {
+    luaL_argerror(L, idx, "expected 32-bit buffer");
+  }
+}
+
 
 static int l_bufferfx_desaturate(lua_State *L) {
   Buffer *self = luaL_checkudata(L, 1, BUFFER_CLASS_NAME);
   int amount = luaL_optnumber(L, 2, 1.) * 0xff;
   amount = CLAMP(amount, 0, 0xff);
-  int i = self->buffer->w * self->buffer->h;
-  sr_Pixel *p = self->buffer->pixels;
-  if (amount >= 0xfe) {
-    /* Full amount? Don't bother with lerping, just write pixel avg */
-    while (i--) {
-      p->rgba.r = p->rgba.g = p->rgba.b =
-        ((p->rgba.r + p->rgba.g + p->rgba.b) * 341) >> 10;
-      p++;
-    }
-  } else {
-    while (i--) {
-      int avg = ((p->rgba.r + p->rgba.g + p->rgba.b) * 341) >> 10;
-      p->rgba.r = LERP(8, p->rgba.r, avg, amount);
-      p->rgba.g = LERP(8, p->rgba.g, avg, amount);
-      p->rgba.b = LERP(8, p->rgba.b, avg, amount);
-      p++;
+  touchBuffer(self);
+  int i, y;
+  for (y = 0; y < self->buffer->h; y++) {
+    sr_Pixel *p = self->buffer->pixels + y * self->buffer->stride;
+    i = self->buffer->w;
+    if (amount >= 0xfe) {
+      /* Full amount? Don't bother with lerping, just write pixel avg */
+      while (i--) {
+        p->rgba.r = p->rgba.g = p->rgba.b =
+          ((p->rgba.r + p->rgba.g + p->rgba.b) * 341) >> 10;
+        p++;
+      }
+    } else {
+      while (i--) {
+        int avg = ((p->rgba.r + p->rgba.g + p->rgba.b) * 341) >> 10;
+        p->rgba.r = LERP(8, p->rgba.r, avg, amount);
+        p->rgba.g = LERP(8, p->rgba.g, avg, amount);
+        p->rgba.b = LERP(8, p->rgba.b, avg, amount);
+        p++;
+      }
     }
-
   }
   return 0;
 }
@@ -104,18 +119,49 @@ static int l_bufferfx_mask(lua_State *L) {
   if (!strchr("rgba", *channel)) {
     luaL_error(L, "expected channel to be 'r', 'g', 'b' or 'a'");
   }
-  int i = self->buffer->w * self->buffer->h;
-  sr_Pixel *d = self->buffer->pixels;
-  sr_Pixel *s = mask->buffer->pixels;
-  while (i--) {
-    switch (*channel) {
-      case 'r' : d->rgba.a = (d->rgba.a * s->rgba.r) >> 8; break;
-      case 'g' : d->rgba.a = (d->rgba.a * s->rgba.g) >> 8; break;
-      case 'b' : d->rgba.a = (d->rgba.a * s->rgba.b) >> 8; break;
-      case 'a' : d->rgba.a = (d->rgba.a * s->rgba.a) >> 8; break;
+  touchBuffer(self);
+  sr_flushCommands(mask->buffer);
+  int premul = sr_isPremultiplied(self->buffer);
+  int a8 = mask->buffer->flags & SR_BUFFER_A8;
+  sr_Pixel *pal = NULL;
+  int x, y;
+  if (mask->buffer->flags & SR_BUFFER_INDEXED) {
+    pal = mask->buffer->palette->colors;
+  }
+  for (y = 0; y < self->buffer->h; y++) {
+    sr_Pixel *d = self->buffer->pixels + y * self->buffer->stride;
+    sr_Pixel *s = NULL;
+    unsigned char *a = NULL;
+    if (a8 || pal) {
+      a = mask->buffer->data + y * mask->buffer->stride;
+    } else {
+      s = mask->buffer->pixels + y * mask->buffer->stride;
+    }
+    for (x = 0; x < self->buffer->w; x++) {
+      int m = 0;
+      if (a8) {
+        /* An A8 mask is white with its coverage as alpha */
+        m = (*channel == 'a') ? a[x] : 0xff;
+      } else {
+        /* An indexed mask's pixels are looked up in its palette */
+        if (pal) s = &pal[a[x]];
+        switch (*channel) {
+          case 'r' : m = s->rgba.r; break;
+          case 'g' : m = s->rgba.g; break;
+          case 'b' : m = s->rgba.b; break;
+          case 'a' : m = s->rgba.a; break;
+        }
+        s++;
+      }
+      d->rgba.a = (d->rgba.a * m) >> 8;
+      /* Premultiplied color channels are scaled along with the alpha */
+      if (premul) {
+        d->rgba.r = (d->rgba.r * m) >> 8;
+        d->rgba.g = (d->rgba.g * m) >> 8;
+        d->rgba.b = (d->rgba.b * m) >> 8;
+      }
+      d++;
     }
-    d++;
-    s++;
   }
   return 0;
 }
@@ -138,15 +184,21 @@ static int l_bufferfx_palette(lua_State *L) {
     pal[i] = getColorFromTable(L, -1);
     lua_pop(L, 1);
   }
+  touchBuffer(self);
   /* Convert each pixel to palette color based on its brightest channel */
-  i = self->buffer->w * self->buffer->h;
-  sr_Pixel *p = self->buffer->pixels;
-  while (i--) {
-    int idx = MAX(MAX(p->rgba.r, p->rgba.b), p->rgba.g);
-    p->rgba.r = pal[idx].rgba.r;
-    p->rgba.g = pal[idx].rgba.g;
-    p->rgba.b = pal[idx].rgba.b;
-    p++;
+  int premul = sr_isPremultiplied(self->buffer);
+  int x, y;
+  for (y = 0; y < self->buffer->h; y++) {
+    sr_Pixel *p = self->buffer->pixels + y * self->buffer->stride;
+    for (x = 0; x < self->buffer->w; x++) {
+      if (premul) *p = sr_unpremultiply(*p);
+      int idx = MAX(MAX(p->rgba.r, p->rgba.b), p->rgba.g);
+      p->rgba.r = pal[idx].rgba.r;
+      p->rgba.g = pal[idx].rgba.g;
+      p->rgba.b = pal[idx].rgba.b;
+      if (premul) *p = sr_premultiply(*p);
+      p++;
+    }
   }
   return 0;
 }
@@ -166,13 +218,18 @@ static int l_bufferfx_dissolve(lua_State *L) {
   amount = luaL_checknumber(L, 2) * 256;
   s |= (unsigned) (luaL_optnumber(L, 3, 0));
   amount = CLAMP(amount, 0, 0xff);
-  int i = self->buffer->w * self->buffer->h;
-  sr_Pixel *p = self->buffer->pixels;
-  while (i--) {
-    if ((xorshift64star(&s) & 0xff) < amount) {
-      p->rgba.a = 0;
+  touchBuffer(self);
+  int premul = sr_isPremultiplied(self->buffer);
+  int x, y;
+  for (y = 0; y < self->buffer->h; y++) {
+    sr_Pixel *p = self->buffer->pixels + y * self->buffer->stride;
+    for (x = 0; x < self->buffer->w; x++) {
+      if ((xorshift64star(&s) & 0xff) < amount) {
+        p->rgba.a = 0;
+        if (premul) p->word = 0;
+      }
+      p++;
     }
-    p++;
   }
   return 0;
 }
@@ -188,15 +245,19 @@ static int l_bufferfx_wave(lua_State *L) {
   int scaleY  = luaL_checknumber(L, 6)  * FX_UNIT;
   int offsetX = luaL_optnumber(L, 7, 0) * FX_UNIT;
   int offsetY = luaL_optnumber(L, 8, 0) * FX_UNIT;
+  touchBuffer(self);
+  sr_flushCommands(src->buffer);
+  int premul = sr_isPremultiplied(self->buffer);
   int x, y;
   for (y = 0; y < self->buffer->h; y++) {
-    sr_Pixel *d = self->buffer->pixels + y * self->buffer->w;
+    sr_Pixel *d = self->buffer->pixels + y * self->buffer->stride;
     int ox = (fxsin(offsetX + ((y * scaleX) >> FX_BITS)) * amountX)
              >> FX_BITS;
     for (x = 0; x < self->buffer->w; x++) {
       int oy = (fxsin(offsetY + ((x * scaleY) >> FX_BITS)) * amountY)
                >> FX_BITS;
       *d = sr_getPixel(src->buffer, x + ox, y + oy);
+      if (premul) *d = sr_premultiply(*d);
       d++;
     }
   }
@@ -225,15 +286,21 @@ static int l_bufferfx_displace(lua_State *L) {
   int x, y;
   checkBufferSizesMatch(L, self, src);
   checkBufferSizesMatch(L, self, map);
+  checkPixels(L, 3, map);
   if (!strchr("rgba", *channelX)) luaL_argerror(L, 4, "bad channel");
   if (!strchr("rgba", *channelY)) luaL_argerror(L, 5, "bad channel");
+  touchBuffer(self);
+  sr_flushCommands(src->buffer);
+  sr_flushCommands(map->buffer);
+  int premul = sr_isPremultiplied(self->buffer);
   for (y = 0; y < self->buffer->h; y++) {
-    sr_Pixel *d = self->buffer->pixels + y * self->buffer->w;
-    sr_Pixel *m = map->buffer->pixels + y * self->buffer->w;
+    sr_Pixel *d = self->buffer->pixels + y * self->buffer->stride;
+    sr_Pixel *m = map->buffer->pixels + y * map->buffer->stride;
     for (x = 0; x < self->buffer->w; x++) {
       int cx = ((getChannel(*m, *channelX) - (1 << 7)) * scaleX) >> 14;
       int cy = ((getChannel(*m, *channelY) - (1 << 7)) * scaleY) >> 14;
       *d = sr_getPixel(src->buffer, x + cx, y + cy);
+      if (premul) *d = sr_premultiply(*d);
       d++;
       m++;
     }
@@ -245,26 +312,35 @@ static int l_bufferfx_displace(lua_State *L) {
 static int l_bufferfx_blur(lua_State *L) {
   Buffer *self = luaL_checkudata(L, 1, BUFFER_CLASS_NAME);
   Buffer *src = luaL_checkudata(L, 2, BUFFER_CLASS_NAME);
+  checkPixels(L, 2, src);
+  checkBufferSizesMatch(L, self, src);
   int radiusx = luaL_checknumber(L, 3);
   int radiusy = luaL_checknumber(L, 4);
+  touchBuffer(self);
+  sr_flushCommands(src->buffer);
   int y, x, ky, kx;
   int r, g, b, r2, g2, b2;
-  sr_Pixel p2;
+  sr_Pixel p2, blank;
   int w = src->buffer->w;
   int h = src->buffer->h;
   int dx = 256 / (radiusx * 2 + 1);
   int dy = 256 / (radiusy * 2 + 1);
   sr_Rect bounds = sr_rect(radiusx, radiusy, w - radiusx, h - radiusy);
-  sr_Pixel *p = self->buffer->pixels;
-  checkBufferSizesMatch(L, self, src);
+  int stride = src->buffer->stride;
+  sr_Pixel *p;
+  blank.word = 0;
   /* do blur */
   for (y = 0; y < h; y++) {
     int inBoundsY = y >= bounds.y && y < bounds.h;
+    p = self->buffer->pixels + y * self->buffer->stride;
     for (x = 0; x < w; x++) {
       /* are the pixels that will be used in bounds? */
       int inBounds = inBoundsY && x >= bounds.x && x < bounds.w;
       /* blur pixel */
-      #define GET_PIXEL_FAST(b, x, y) ((b)->pixels[(x) + (y) * w])
+      #define GET_PIXEL_FAST(b, x, y) ((b)->pixels[(x) + (y) * stride])
+      #define GET_PIXEL_SAFE(b, x, y)\
+        (((x) >= 0 && (y) >= 0 && (x) < w && (y) < h) ?\
+          GET_PIXEL_FAST(b, x, y) : blank)
       #define BLUR_PIXEL(GET_PIXEL)                      \
         r = 0, g = 0, b = 0;                             \
         for (ky = -radiusy; ky <= radiusy; ky++) {       \
@@ -282,7 +358,7 @@ static int l_bufferfx_blur(lua_State *L) {
       if (inBounds) {
         BLUR_PIXEL(GET_PIXEL_FAST)
       } else {
-        BLUR_PIXEL(sr_getPixel)
+        BLUR_PIXEL(GET_PIXEL_SAFE)
       }
       /* set pixel */
       p->rgba.r = (r * dy) >> 8;
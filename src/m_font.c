@@ -102,8 +102,8 @@ static int l_font_render(lua_State *L) {
   if (!data) {
     luaL_error(L, "could not render text");
   }
-  /* Load bitmap and free intermediate 8bit bitmap */
-  b->buffer = sr_newBuffer(w, h);
+  /* Load bitmap into an alpha-only buffer and free intermediate bitmap */
+  b->buffer = sr_newBufferA8(w, h);
   if (!b->buffer) {
     free(data);
     luaL_error(L, "could not create buffer");
@@ -76,17 +76,26 @@ static int l_gif_update(lua_State *L) {
     luaL_error(L, "bad buffer dimensions for gif object, expected %dx%d",
                self->w, self->h);
   }
+  if (buf->buffer->flags & (SR_BUFFER_A8 | SR_BUFFER_INDEXED)) {
+    luaL_argerror(L, 2, "expected 32-bit buffer");
+  }
   /* Copy pixels to buffer -- jo_gif expects a specific channel byte-order
    * which may differ from what sera is using -- alpha channel isn't copied
-   * since jo_gif doesn't use this */
-  int i, n;
-  int len = self->w * self->h;
-  sr_Pixel *p = buf->buffer->pixels;
-  for (i = 0; i < len; i++) {
-    n = i * 4;
-    self->buf[n    ] = p[i].rgba.r;
-    self->buf[n + 1] = p[i].rgba.g;
-    self->buf[n + 2] = p[i].rgba.b;
+   * since jo_gif doesn't use this. Premultiplied pixels are unpremultiplied
+   * so translucent colors aren't darkened */
+  int i, n, y;
+  sr_Pixel *p, c;
+  sr_flushCommands(buf->buffer);
+  int premul = sr_isPremultiplied(buf->buffer);
+  for (y = 0; y < self->h; y++) {
+    p = buf->buffer->pixels + y * buf->buffer->stride;
+    for (i = 0; i < self->w; i++) {
+      c = premul ? sr_unpremultiply(p[i]) : p[i];
+      n = (i + y * self->w) * 4;
+      self->buf[n    ] = c.rgba.r;
+      self->buf[n + 1] = c.rgba.g;
+      self->buf[n + 2] = c.rgba.b;
+    }
   }
   /* Update */
   jo_gif_frame(&self->gif, self->buf, delay, 0);
@@ -15,6 +15,7 @@
 #include "util.h"
 #include "luax.h"
 #include "m_buffer.h"
+#include "pool.h"
 
 double m_graphics_maxFps = 60.;
 
@@ -24,10 +25,15 @@ static int screenHeight = 0;
 static int screenRef = 0;
 static int fullscreen = 0;
 static int resizable = 0;
+static int presentDirty = 0;
 Buffer *screen;
 
 
 static void resetVideoMode(lua_State *L) {
+  /* Draw any recorded commands while the old surface is still valid */
+  if (screen) {
+    sr_flushCommands(screen->buffer);
+  }
   /* Reset video mode */
   int flags = (fullscreen ? SDL_FULLSCREEN : 0) |
               (resizable  ? SDL_RESIZABLE : 0);
@@ -40,7 +46,40 @@ static void resetVideoMode(lua_State *L) {
     b->pixels = (void*) SDL_GetVideoSurface()->pixels;
     b->w = screenWidth;
     b->h = screenHeight;
+    b->stride = SDL_GetVideoSurface()->pitch / sizeof(sr_Pixel);
     sr_setClip(b, sr_rect(0, 0, b->w, b->h));
+    /* Restart dirty tracking so the whole new surface is presented */
+    sr_setDirtyTracking(b, 0);
+    sr_setDirtyTracking(b, 1);
+  }
+}
+
+
+void m_graphics_present(void) {
+  SDL_Surface *surface = SDL_GetVideoSurface();
+  SDL_Rect rects[SR_MAX_DIRTY * 2];
+  sr_Dirty *d;
+  int i, n;
+  if (!surface) return;
+  if (!screen || !screen->buffer->dirty || !presentDirty) {
+    SDL_Flip(surface);
+  } else {
+    /* Present the areas drawn this frame and the areas drawn last frame, which
+     * may since have been cleared */
+    d = screen->buffer->dirty;
+    n = 0;
+    for (i = 0; i < d->count + d->lastCount; i++) {
+      sr_Rect *r = (i < d->count) ? &d->rects[i] : &d->last[i - d->count];
+      rects[n].x = r->x;
+      rects[n].y = r->y;
+      rects[n].w = r->w;
+      rects[n].h = r->h;
+      n++;
+    }
+    SDL_UpdateRects(surface, n, rects);
+  }
+  if (screen) {
+    sr_resetDirty(screen->buffer);
   }
 }
 
@@ -68,6 +107,11 @@ static int l_graphics_init(lua_State *L) {
   screen = buffer_new(L);
   screen->buffer = sr_newBufferShared(
     SDL_GetVideoSurface()->pixels, screenWidth, screenHeight);
+  screen->buffer->stride = SDL_GetVideoSurface()->pitch / sizeof(sr_Pixel);
+  /* The screen's alpha channel is never displayed, let sera treat it as
+   * opaque so it can use its faster blend paths */
+  screen->buffer->flags |= SR_BUFFER_OPAQUE;
+  sr_setDirtyTracking(screen->buffer, 1);
   lua_pushvalue(L, -1);
   screenRef = lua_ref(L, LUA_REGISTRYINDEX);
   /* Set state */
@@ -89,11 +133,52 @@ static int l_graphics_setMaxFps(lua_State *L) {
 }
 
 
+static int l_graphics_setPresentMode(lua_State *L) {
+  const char *str = luaL_optstring(L, 1, "full");
+  if      (!strcmp(str, "full" )) presentDirty = 0;
+  else if (!strcmp(str, "dirty")) presentDirty = 1;
+  else luaL_argerror(L, 1, "bad present mode");
+  return 0;
+}
+
+
+static int l_graphics_setThreads(lua_State *L) {
+  int n = luaL_optint(L, 1, 1);
+  sr_setParallel(NULL, 0);
+  if (pool_init(n) != 0) {
+    luaL_error(L, "could not create worker threads");
+  }
+  /* Large draw operations are split into bands across the pool */
+  if (pool_threads() > 1) {
+    sr_setParallel(pool_run, pool_threads());
+  }
+  return 0;
+}
+
+
+static int l_graphics_setRotationCacheBudget(lua_State *L) {
+  int bytes = luaL_checknumber(L, 1);
+  if (bytes < 0) luaL_argerror(L, 1, "expected budget of 0 or greater");
+  sr_setRotationCacheBudget(bytes);
+  return 0;
+}
+
+
+static int l_graphics_setRowPadding(lua_State *L) {
+  sr_setRowPadding(luax_optboolean(L, 1, 1));
+  return 0;
+}
+
+
 int luaopen_graphics(lua_State *L) {
   luaL_Reg reg[] = {
     { "init",           l_graphics_init           },
     { "setFullscreen",  l_graphics_setFullscreen  },
     { "setMaxFps",      l_graphics_setMaxFps      },
+    { "setThreads",     l_graphics_setThreads     },
+    { "setPresentMode", l_graphics_setPresentMode },
+    { "setRotationCacheBudget", l_graphics_setRotationCacheBudget },
+    { "setRowPadding",  l_graphics_setRowPadding  },
     { NULL, NULL }
   };
   luaL_newlib(L, reg);
@@ -30,6 +30,11 @@ int luaopen_font(lua_State *L);
 int luaopen_source(lua_State *L);
 int luaopen_data(lua_State *L);
 int luaopen_gif(lua_State *L);
+int luaopen_atlas(lua_State *L);
+int luaopen_quad(lua_State *L);
+int luaopen_tilemap(lua_State *L);
+int luaopen_particles(lua_State *L);
+int luaopen_palette(lua_State *L);
 
 int luaopen_juno(lua_State *L) {
   luaL_Reg reg[] = {
@@ -47,6 +52,11 @@ int luaopen_juno(lua_State *L) {
     { "Source",   luaopen_source    },
     { "Data",     luaopen_data      },
     { "Gif",      luaopen_gif       },
+    { "Atlas",    luaopen_atlas     },
+    { "Quad",     luaopen_quad      },
+    { "TileMap",  luaopen_tilemap   },
+    { "ParticleSystem", luaopen_particles },
+    { "Palette",  luaopen_palette   },
     /* Modules */
     { "system",   luaopen_system    },
     { "fs",       luaopen_fs        },
@@ -0,0 +1,142 @@
+/** 
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "luax.h"
+#include "m_palette.h"
+
+#define CLASS_NAME PALETTE_CLASS_NAME
+
+/* A palette holds the 256 colors the pixels of indexed buffers are looked up
+ * in when they are drawn, so changing a color changes every pixel of that
+ * index in every buffer using the palette */
+
+
+static sr_Pixel getColorFromTable(lua_State *L, int idx) {
+  int i, c[4];
+  if (lua_type(L, idx) != LUA_TTABLE) {
+    luaL_error(L, "expected table");
+  }
+  for (i = 0; i < 4; i++) {
+    lua_rawgeti(L, idx, i + 1);
+    c[i] = luaL_optnumber(L, -1, 1) * 256;
+    lua_pop(L, 1);
+  }
+  return sr_pixel(c[0], c[1], c[2], c[3]);
+}
+
+
+static int checkIndex(lua_State *L, int idx) {
+  int i = luaL_checknumber(L, idx);
+  if (i < 0 || i > 255) {
+    luaL_argerror(L, idx, "expected index between 0 and 255");
+  }
+  return i;
+}
+
+
+static void setColors(lua_State *L, Palette *self, int idx, int first) {
+  sr_Pixel colors[256];
+  int i, n = lua_rawlen(L, idx);
+  if (first + n > 256) {
+    luaL_error(L, "too many colors");
+  }
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, idx, i + 1);
+    colors[i] = getColorFromTable(L, -1);
+    lua_pop(L, 1);
+  }
+  sr_setPaletteColors(&self->palette, colors, first, n);
+}
+
+
+static int l_palette_new(lua_State *L) {
+  int hasColors = !lua_isnoneornil(L, 1);
+  if (hasColors) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+  }
+  Palette *self = lua_newuserdata(L, sizeof(*self));
+  luaL_setmetatable(L, CLASS_NAME);
+  memset(self, 0, sizeof(*self));
+  if (hasColors) {
+    setColors(L, self, 1, 0);
+  }
+  return 1;
+}
+
+
+static int l_palette_getColor(lua_State *L) {
+  Palette *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_Pixel px = self->palette.colors[checkIndex(L, 2)];
+  lua_pushnumber(L, px.rgba.r * 0.00390625); /* div 256. */
+  lua_pushnumber(L, px.rgba.g * 0.00390625);
+  lua_pushnumber(L, px.rgba.b * 0.00390625);
+  lua_pushnumber(L, px.rgba.a * 0.00390625);
+  return 4;
+}
+
+
+static int l_palette_setColor(lua_State *L) {
+  Palette *self = luaL_checkudata(L, 1, CLASS_NAME);
+  int i = checkIndex(L, 2);
+  int r = luaL_optnumber(L, 3, 1) * 256;
+  int g = luaL_optnumber(L, 4, 1) * 256;
+  int b = luaL_optnumber(L, 5, 1) * 256;
+  int a = luaL_optnumber(L, 6, 1) * 256;
+  sr_Pixel px = sr_pixel(r, g, b, a);
+  sr_setPaletteColors(&self->palette, &px, i, 1);
+  return 0;
+}
+
+
+static int l_palette_setColors(lua_State *L) {
+  Palette *self = luaL_checkudata(L, 1, CLASS_NAME);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  setColors(L, self, 2, lua_isnoneornil(L, 3) ? 0 : checkIndex(L, 3));
+  return 0;
+}
+
+
+static int l_palette_cycle(lua_State *L) {
+  Palette *self = luaL_checkudata(L, 1, CLASS_NAME);
+  int first = checkIndex(L, 2);
+  int last = checkIndex(L, 3);
+  int n = luaL_optnumber(L, 4, 1);
+  sr_Pixel colors[256];
+  int i, len;
+  if (last < first) {
+    luaL_argerror(L, 3, "expected index not less than first");
+  }
+  /* Move each color of the range `n` places up, wrapping around */
+  len = last - first + 1;
+  n = ((n % len) + len) % len;
+  for (i = 0; i < len; i++) {
+    colors[(i + n) % len] = self->palette.colors[first + i];
+  }
+  sr_setPaletteColors(&self->palette, colors, first, len);
+  return 0;
+}
+
+
+int luaopen_palette(lua_State *L) {
+  luaL_Reg reg[] = {
+    { "new",          l_palette_new       },
+    { "getColor",     l_palette_getColor  },
+    { "setColor",     l_palette_setColor  },
+    { "setColors",    l_palette_setColors },
+    { "cycle",        l_palette_cycle     },
+    { NULL, NULL }
+  };
+  ASSERT( luaL_newmetatable(L, CLASS_NAME) );
+  luaL_setfuncs(L, reg, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
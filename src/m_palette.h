@@ -0,0 +1,21 @@
+/** 
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+
+#ifndef M_PALETTE_H
+#define M_PALETTE_H
+
+#include "luax.h"
+#include "lib/sera/sera.h"
+
+#define PALETTE_CLASS_NAME "Palette"
+
+typedef struct {
+  sr_Palette palette;
+} Palette;
+
+#endif
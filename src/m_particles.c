@@ -0,0 +1,264 @@
+/** 
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "util.h"
+#include "luax.h"
+#include "m_buffer.h"
+
+#define CLASS_NAME "ParticleSystem"
+
+/* Particle state is kept as one array per field so the update step is a few
+ * straight loops over floats which the compiler can vectorize. A particle
+ * stays fully opaque until its life falls under the fade time, then fades
+ * out and is removed when its life reaches 0 */
+
+typedef struct {
+  float *x, *y, *vx, *vy, *life, *alpha, *scale;
+} Particles;
+
+typedef struct {
+  sr_Buffer *texture;
+  int textureRef;
+  Particles p;
+  int count, capacity;
+  unsigned seed;
+  float rate, emitAcc;
+  float ex, ey, radius;
+  float vxMin, vxMax, vyMin, vyMax;
+  float ax, ay;
+  float lifeMin, lifeMax, fade;
+  float scaleMin, scaleMax;
+} ParticleSystem;
+
+
+static float randRange(ParticleSystem *self, float min, float max) {
+  self->seed = self->seed * 1664525 + 1013904223;
+  return min + (max - min) * ((self->seed >> 8) / (float) (1 << 24));
+}
+
+
+static void emit(ParticleSystem *self, int n) {
+  Particles *p = &self->p;
+  float r;
+  int i;
+  n = CLAMP(n, 0, self->capacity - self->count);
+  for (i = self->count; i < self->count + n; i++) {
+    r = randRange(self, 0, M_PI * 2);
+    p->x[i] = self->ex + cos(r) * self->radius;
+    p->y[i] = self->ey + sin(r) * self->radius;
+    p->vx[i] = randRange(self, self->vxMin, self->vxMax);
+    p->vy[i] = randRange(self, self->vyMin, self->vyMax);
+    p->life[i] = randRange(self, self->lifeMin, self->lifeMax) + self->fade;
+    p->alpha[i] = 1;
+    p->scale[i] = randRange(self, self->scaleMin, self->scaleMax);
+  }
+  self->count += n;
+}
+
+
+static void update(ParticleSystem *self, float dt) {
+  Particles *p = &self->p;
+  float fade = (self->fade > 0) ? 1 / self->fade : 1e9;
+  int i, j, n = self->count;
+  /* Step */
+  for (i = 0; i < n; i++) {
+    p->vx[i] += self->ax * dt;
+    p->vy[i] += self->ay * dt;
+  }
+  for (i = 0; i < n; i++) {
+    p->x[i] += p->vx[i] * dt;
+    p->y[i] += p->vy[i] * dt;
+  }
+  for (i = 0; i < n; i++) {
+    p->life[i] -= dt;
+    p->alpha[i] = CLAMP(p->life[i] * fade, 0, 1);
+  }
+  /* Remove dead particles, moving the last particle into each gap */
+  for (i = 0; i < n; i++) {
+    while (i < n && p->life[i] <= 0) {
+      j = --n;
+      p->x[i] = p->x[j];
+      p->y[i] = p->y[j];
+      p->vx[i] = p->vx[j];
+      p->vy[i] = p->vy[j];
+      p->life[i] = p->life[j];
+      p->alpha[i] = p->alpha[j];
+      p->scale[i] = p->scale[j];
+    }
+  }
+  self->count = n;
+}
+
+
+static int l_particles_new(lua_State *L) {
+  Buffer *texture = luaL_checkudata(L, 1, BUFFER_CLASS_NAME);
+  int capacity = luaL_optnumber(L, 2, 1000);
+  float *data;
+  if (capacity <= 0) {
+    luaL_argerror(L, 2, "expected capacity greater than 0");
+  }
+  ParticleSystem *self = lua_newuserdata(L, sizeof(*self));
+  luaL_setmetatable(L, CLASS_NAME);
+  memset(self, 0, sizeof(*self));
+  self->textureRef = LUA_NOREF;
+  /* Init texture */
+  self->texture = texture->buffer;
+  lua_pushvalue(L, 1);
+  self->textureRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  /* Init particle arrays */
+  data = malloc(capacity * 7 * sizeof(*data));
+  if (!data) {
+    luaL_error(L, "out of memory");
+  }
+  self->p.x     = data;
+  self->p.y     = data + capacity;
+  self->p.vx    = data + capacity * 2;
+  self->p.vy    = data + capacity * 3;
+  self->p.life  = data + capacity * 4;
+  self->p.alpha = data + capacity * 5;
+  self->p.scale = data + capacity * 6;
+  self->capacity = capacity;
+  /* Init emitter */
+  self->seed = 1;
+  self->lifeMin = self->lifeMax = 1;
+  self->scaleMin = self->scaleMax = 1;
+  return 1;
+}
+
+
+static int l_particles_gc(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  free(self->p.x);
+  luaL_unref(L, LUA_REGISTRYINDEX, self->textureRef);
+  return 0;
+}
+
+
+static int l_particles_getCount(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_pushnumber(L, self->count);
+  return 1;
+}
+
+
+static int l_particles_setPosition(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  self->ex = luaL_checknumber(L, 2);
+  self->ey = luaL_checknumber(L, 3);
+  self->radius = luaL_optnumber(L, 4, 0);
+  return 0;
+}
+
+
+static int l_particles_setVelocity(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  self->vxMin = luaL_checknumber(L, 2);
+  self->vxMax = luaL_checknumber(L, 3);
+  self->vyMin = luaL_optnumber(L, 4, self->vxMin);
+  self->vyMax = luaL_optnumber(L, 5, self->vxMax);
+  return 0;
+}
+
+
+static int l_particles_setAcceleration(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  self->ax = luaL_checknumber(L, 2);
+  self->ay = luaL_checknumber(L, 3);
+  return 0;
+}
+
+
+static int l_particles_setLifetime(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  self->lifeMin = luaL_checknumber(L, 2);
+  self->lifeMax = luaL_optnumber(L, 3, self->lifeMin);
+  self->fade = luaL_optnumber(L, 4, 0);
+  return 0;
+}
+
+
+static int l_particles_setScale(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  self->scaleMin = luaL_checknumber(L, 2);
+  self->scaleMax = luaL_optnumber(L, 3, self->scaleMin);
+  return 0;
+}
+
+
+static int l_particles_setRate(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  self->rate = luaL_checknumber(L, 2);
+  return 0;
+}
+
+
+static int l_particles_emit(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  emit(self, luaL_optnumber(L, 2, 1));
+  return 0;
+}
+
+
+static int l_particles_clear(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  self->count = 0;
+  return 0;
+}
+
+
+static int l_particles_update(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  float dt = luaL_checknumber(L, 2);
+  int n;
+  update(self, dt);
+  /* Emit new particles at the emission rate */
+  self->emitAcc += self->rate * dt;
+  n = self->emitAcc;
+  self->emitAcc -= n;
+  emit(self, n);
+  return 0;
+}
+
+
+static int l_particles_draw(lua_State *L) {
+  ParticleSystem *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_Buffer *b = ((Buffer*) luaL_checkudata(L, 2, BUFFER_CLASS_NAME))->buffer;
+  int x = luaL_optnumber(L, 3, 0);
+  int y = luaL_optnumber(L, 4, 0);
+  sr_drawParticles(b, self->texture, x, y, self->p.x, self->p.y,
+                   self->p.scale, self->p.alpha, self->count);
+  return 0;
+}
+
+
+int luaopen_particles(lua_State *L) {
+  luaL_Reg reg[] = {
+    { "__gc",             l_particles_gc              },
+    { "new",              l_particles_new             },
+    { "getCount",         l_particles_getCount        },
+    { "setPosition",      l_particles_setPosition     },
+    { "setVelocity",      l_particles_setVelocity     },
+    { "setAcceleration",  l_particles_setAcceleration },
+    { "setLifetime",      l_particles_setLifetime     },
+    { "setScale",         l_particles_setScale        },
+    { "setRate",          l_particles_setRate         },
+    { "emit",             l_particles_emit            },
+    { "clear",            l_particles_clear           },
+    { "update",           l_particles_update          },
+    { "draw",             l_particles_draw            },
+    { NULL, NULL }
+  };
+  ASSERT( luaL_newmetatable(L, CLASS_NAME) );
+  luaL_setfuncs(L, reg, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
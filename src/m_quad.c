@@ -0,0 +1,105 @@
+/** 
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "luax.h"
+#include "m_buffer.h"
+#include "m_quad.h"
+
+#define CLASS_NAME QUAD_CLASS_NAME
+
+
+/* Pushes a new quad of the rect `r` of the Buffer at `idx`; the rect is
+ * expected to be within the buffer */
+Quad *quad_new(lua_State *L, int idx, sr_Rect r) {
+  Buffer *b = luaL_checkudata(L, idx, BUFFER_CLASS_NAME);
+  idx = lua_absindex(L, idx);
+  Quad *self = lua_newuserdata(L, sizeof(*self));
+  luaL_setmetatable(L, CLASS_NAME);
+  self->buffer = b->buffer;
+  self->rect = r;
+  lua_pushvalue(L, idx);
+  self->bufferRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  return self;
+}
+
+
+static int l_quad_new(lua_State *L) {
+  Buffer *b = luaL_checkudata(L, 1, BUFFER_CLASS_NAME);
+  int x = luaL_checknumber(L, 2);
+  int y = luaL_checknumber(L, 3);
+  int w = luaL_checknumber(L, 4);
+  int h = luaL_checknumber(L, 5);
+  if (w <= 0 || h <= 0) {
+    luaL_error(L, "expected width and height greater than 0");
+  }
+  if (x < 0 || y < 0 || x + w > b->buffer->w || y + h > b->buffer->h) {
+    luaL_error(L, "quad out of bounds of buffer");
+  }
+  quad_new(L, 1, sr_rect(x, y, w, h));
+  return 1;
+}
+
+
+static int l_quad_gc(lua_State *L) {
+  Quad *self = luaL_checkudata(L, 1, CLASS_NAME);
+  luaL_unref(L, LUA_REGISTRYINDEX, self->bufferRef);
+  return 0;
+}
+
+
+static int l_quad_getRect(lua_State *L) {
+  Quad *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_pushnumber(L, self->rect.x);
+  lua_pushnumber(L, self->rect.y);
+  lua_pushnumber(L, self->rect.w);
+  lua_pushnumber(L, self->rect.h);
+  return 4;
+}
+
+
+static int l_quad_getWidth(lua_State *L) {
+  Quad *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_pushnumber(L, self->rect.w);
+  return 1;
+}
+
+
+static int l_quad_getHeight(lua_State *L) {
+  Quad *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_pushnumber(L, self->rect.h);
+  return 1;
+}
+
+
+static int l_quad_getBuffer(lua_State *L) {
+  Quad *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, self->bufferRef);
+  return 1;
+}
+
+
+int luaopen_quad(lua_State *L) {
+  luaL_Reg reg[] = {
+    { "__gc",         l_quad_gc         },
+    { "new",          l_quad_new        },
+    { "getRect",      l_quad_getRect    },
+    { "getWidth",     l_quad_getWidth   },
+    { "getHeight",    l_quad_getHeight  },
+    { "getBuffer",    l_quad_getBuffer  },
+    { NULL, NULL }
+  };
+  ASSERT( luaL_newmetatable(L, CLASS_NAME) );
+  luaL_setfuncs(L, reg, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
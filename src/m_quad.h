@@ -0,0 +1,25 @@
+/** 
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+
+#ifndef M_QUAD_H
+#define M_QUAD_H
+
+#include "luax.h"
+#include "lib/sera/sera.h"
+
+#define QUAD_CLASS_NAME "Quad"
+
+typedef struct {
+  sr_Buffer *buffer;
+  sr_Rect rect;
+  int bufferRef;
+} Quad;
+
+Quad *quad_new(lua_State *L, int idx, sr_Rect r);
+
+#endif
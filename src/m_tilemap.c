@@ -0,0 +1,180 @@
+/** 
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "luax.h"
+#include "m_buffer.h"
+
+#define CLASS_NAME "TileMap"
+
+/* Tiles are numbered from 1 in reading order across the tileset; 0 is an
+ * empty cell. The map is drawn with sr_drawTiles(), which uses the tileset's
+ * run index to skip transparent pixels and copy opaque ones; the index is
+ * rebuilt whenever the tileset is written to */
+
+typedef struct {
+  sr_Buffer *tileset;
+  int tilesetRef;
+  int tileWidth, tileHeight;
+  int count;
+  int w, h;
+  int *tiles;
+} TileMap;
+
+
+static int *getCell(lua_State *L, TileMap *self, int xidx) {
+  int x = luaL_checknumber(L, xidx);
+  int y = luaL_checknumber(L, xidx + 1);
+  if (x < 0 || y < 0 || x >= self->w || y >= self->h) {
+    luaL_error(L, "cell out of bounds");
+  }
+  return &self->tiles[x + y * self->w];
+}
+
+
+static int checkTile(lua_State *L, TileMap *self, int idx) {
+  int tile = luaL_checknumber(L, idx);
+  if (tile < 0 || tile > self->count) {
+    luaL_argerror(L, idx, "bad tile index");
+  }
+  return tile;
+}
+
+
+static int l_tilemap_new(lua_State *L) {
+  Buffer *tileset = luaL_checkudata(L, 1, BUFFER_CLASS_NAME);
+  int tw = luaL_checknumber(L, 2);
+  int th = luaL_checknumber(L, 3);
+  int w = luaL_checknumber(L, 4);
+  int h = luaL_checknumber(L, 5);
+  if (tw <= 0 || tw > tileset->buffer->w) {
+    luaL_argerror(L, 2, "bad tile width");
+  }
+  if (th <= 0 || th > tileset->buffer->h) {
+    luaL_argerror(L, 3, "bad tile height");
+  }
+  if (w <= 0) luaL_argerror(L, 4, "expected width greater than 0");
+  if (h <= 0) luaL_argerror(L, 5, "expected height greater than 0");
+  TileMap *self = lua_newuserdata(L, sizeof(*self));
+  luaL_setmetatable(L, CLASS_NAME);
+  memset(self, 0, sizeof(*self));
+  self->tilesetRef = LUA_NOREF;
+  /* Init tileset */
+  self->tileset = tileset->buffer;
+  lua_pushvalue(L, 1);
+  self->tilesetRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  self->tileWidth = tw;
+  self->tileHeight = th;
+  self->count = (tileset->buffer->w / tw) * (tileset->buffer->h / th);
+  /* Init grid */
+  self->w = w;
+  self->h = h;
+  self->tiles = calloc(w * h, sizeof(*self->tiles));
+  if (!self->tiles) {
+    luaL_error(L, "out of memory");
+  }
+  return 1;
+}
+
+
+static int l_tilemap_gc(lua_State *L) {
+  TileMap *self = luaL_checkudata(L, 1, CLASS_NAME);
+  free(self->tiles);
+  luaL_unref(L, LUA_REGISTRYINDEX, self->tilesetRef);
+  return 0;
+}
+
+
+static int l_tilemap_getSize(lua_State *L) {
+  TileMap *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_pushnumber(L, self->w);
+  lua_pushnumber(L, self->h);
+  return 2;
+}
+
+
+static int l_tilemap_getTileSize(lua_State *L) {
+  TileMap *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_pushnumber(L, self->tileWidth);
+  lua_pushnumber(L, self->tileHeight);
+  return 2;
+}
+
+
+static int l_tilemap_getTile(lua_State *L) {
+  TileMap *self = luaL_checkudata(L, 1, CLASS_NAME);
+  lua_pushnumber(L, *getCell(L, self, 2));
+  return 1;
+}
+
+
+static int l_tilemap_setTile(lua_State *L) {
+  TileMap *self = luaL_checkudata(L, 1, CLASS_NAME);
+  int *cell = getCell(L, self, 2);
+  *cell = checkTile(L, self, 4);
+  return 0;
+}
+
+
+static int l_tilemap_setTiles(lua_State *L) {
+  TileMap *self = luaL_checkudata(L, 1, CLASS_NAME);
+  int i, n, x, y, w, h, *row;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  x = luaL_optnumber(L, 3, 0);
+  y = luaL_optnumber(L, 4, 0);
+  w = luaL_optnumber(L, 5, self->w - x);
+  /* The table holds rows of `w` tiles to be set at x, y */
+  n = lua_rawlen(L, 2);
+  if (w <= 0 || n % w != 0) {
+    luaL_argerror(L, 5, "bad width");
+  }
+  h = n / w;
+  if (x < 0 || y < 0 || x + w > self->w || y + h > self->h) {
+    luaL_error(L, "region out of bounds");
+  }
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    row = self->tiles + (y + i / w) * self->w + x;
+    row[i % w] = checkTile(L, self, -1);
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+
+static int l_tilemap_draw(lua_State *L) {
+  TileMap *self = luaL_checkudata(L, 1, CLASS_NAME);
+  sr_Buffer *b = ((Buffer*) luaL_checkudata(L, 2, BUFFER_CLASS_NAME))->buffer;
+  int x = luaL_optnumber(L, 3, 0);
+  int y = luaL_optnumber(L, 4, 0);
+  sr_drawTiles(b, self->tileset, x, y, self->tileWidth, self->tileHeight,
+               self->tiles, self->w, self->h);
+  return 0;
+}
+
+
+int luaopen_tilemap(lua_State *L) {
+  luaL_Reg reg[] = {
+    { "__gc",         l_tilemap_gc          },
+    { "new",          l_tilemap_new         },
+    { "getSize",      l_tilemap_getSize     },
+    { "getTileSize",  l_tilemap_getTileSize },
+    { "getTile",      l_tilemap_getTile     },
+    { "setTile",      l_tilemap_setTile     },
+    { "setTiles",     l_tilemap_setTiles    },
+    { "draw",         l_tilemap_draw        },
+    { NULL, NULL }
+  };
+  ASSERT( luaL_newmetatable(L, CLASS_NAME) );
+  luaL_setfuncs(L, reg, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
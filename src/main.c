@@ -13,14 +13,17 @@
 #include "util.h"
 #include "luax.h"
 #include "m_source.h"
+#include "pool.h"
 
 
 extern double m_graphics_maxFps;
+void m_graphics_present(void);
 
 static lua_State *L;
 static SDL_mutex *luaMutex;
 
 static void shutdown(void) {
+  pool_deinit();
 #ifndef __APPLE__
   SDL_UnlockMutex(luaMutex);
   SDL_Quit();
@@ -114,11 +117,8 @@ int main(int argc, char **argv) {
     }
     ASSERT(SDL_UnlockMutex(luaMutex) == 0);
     if (screen && SDL_MUSTLOCK(screen)) SDL_UnlockSurface(screen);
-    /* Flip -- this blocks on some platforms (OSX) */
-    SDL_Surface *screen = SDL_GetVideoSurface();
-    if (screen) {
-      SDL_Flip(screen);
-    }
+    /* Present -- this blocks on some platforms (OSX) */
+    m_graphics_present();
     /* Wait for next frame */
     double step = (1. / m_graphics_maxFps);
     double now = SDL_GetTicks() / 1000.;
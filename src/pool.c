@@ -0,0 +1,136 @@
+/** 
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+
+#include <stdlib.h>
+#include <SDL/SDL.h>
+#include "pool.h"
+
+#define MAX_THREADS 32
+
+static SDL_Thread *threads[MAX_THREADS];
+static int threadCount;
+static SDL_mutex *mutex;
+static SDL_cond *jobCond;
+static SDL_cond *doneCond;
+
+/* Current job; `generation` is incremented each time a new job is posted so
+ * sleeping workers can tell a new job apart from a spurious wakeup */
+static pool_Func jobFunc;
+static void *jobUdata;
+static int jobCount;
+static int jobNext;
+static int jobDone;
+static int generation;
+static int quit;
+
+
+/* Takes and runs items of the current job until there are none left. Must be
+ * called with the mutex locked, returns with it locked */
+static void work(void) {
+  int idx;
+  while (jobNext < jobCount) {
+    idx = jobNext++;
+    SDL_UnlockMutex(mutex);
+    jobFunc(jobUdata, idx);
+    SDL_LockMutex(mutex);
+    if (++jobDone == jobCount) {
+      SDL_CondSignal(doneCond);
+    }
+  }
+}
+
+
+static int worker(void *udata) {
+  int gen = 0;
+  (void) udata;
+  SDL_LockMutex(mutex);
+  while (!quit) {
+    if (gen != generation) {
+      gen = generation;
+      work();
+    } else {
+      SDL_CondWait(jobCond, mutex);
+    }
+  }
+  SDL_UnlockMutex(mutex);
+  return 0;
+}
+
+
+int pool_init(int n) {
+  pool_deinit();
+  /* The calling thread always takes part in a job, so only n - 1 additional
+   * threads are created */
+  if (n > MAX_THREADS) n = MAX_THREADS;
+  if (n <= 1) return 0;
+  mutex = SDL_CreateMutex();
+  jobCond = SDL_CreateCond();
+  doneCond = SDL_CreateCond();
+  if (!mutex || !jobCond || !doneCond) goto fail;
+  quit = 0;
+  while (threadCount < n - 1) {
+    threads[threadCount] = SDL_CreateThread(worker, NULL);
+    if (!threads[threadCount]) goto fail;
+    threadCount++;
+  }
+  return 0;
+fail:
+  pool_deinit();
+  return -1;
+}
+
+
+void pool_deinit(void) {
+  int i;
+  if (mutex) {
+    SDL_LockMutex(mutex);
+    quit = 1;
+    SDL_CondBroadcast(jobCond);
+    SDL_UnlockMutex(mutex);
+  }
+  for (i = 0; i < threadCount; i++) {
+    SDL_WaitThread(threads[i], NULL);
+  }
+  threadCount = 0;
+  if (doneCond) SDL_DestroyCond(doneCond);
+  if (jobCond) SDL_DestroyCond(jobCond);
+  if (mutex) SDL_DestroyMutex(mutex);
+  doneCond = jobCond = NULL;
+  mutex = NULL;
+}
+
+
+int pool_threads(void) {
+  return threadCount + 1;
+}
+
+
+void pool_run(pool_Func fn, void *udata, int n) {
+  int i;
+  /* No workers? Run everything on the calling thread */
+  if (threadCount == 0) {
+    for (i = 0; i < n; i++) {
+      fn(udata, i);
+    }
+    return;
+  }
+  /* Post job, help with it, then wait for the workers to finish theirs */
+  SDL_LockMutex(mutex);
+  jobFunc = fn;
+  jobUdata = udata;
+  jobCount = n;
+  jobNext = 0;
+  jobDone = 0;
+  generation++;
+  SDL_CondBroadcast(jobCond);
+  work();
+  while (jobDone < jobCount) {
+    SDL_CondWait(doneCond, mutex);
+  }
+  SDL_UnlockMutex(mutex);
+}
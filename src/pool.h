@@ -0,0 +1,19 @@
+/** 
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+
+#ifndef POOL_H
+#define POOL_H
+
+typedef void (*pool_Func)(void *udata, int idx);
+
+int pool_init(int threads);
+void pool_deinit(void);
+int pool_threads(void);
+void pool_run(pool_Func fn, void *udata, int n);
+
+#endif
@@ -0,0 +1,745 @@
+/**
+ * Copyright (c) 2015 rxi
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+/* Tests for sera, built and run from the repo's root with:
+ *   gcc -Isrc test/sera_test.c src/lib/sera/sera.c -lm -o sera_test
+ *   ./sera_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lib/sera/sera.h"
+
+#define MIN(a, b) ((b) < (a) ? (b) : (a))
+
+static int failures;
+
+#define expect(cond)\
+  do {\
+    if (!(cond)) {\
+      fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond);\
+      failures++;\
+    }\
+  } while (0)
+
+
+/* New buffers' pixels are left as they are, so buffers compared after
+ * drawing to them are cleared first */
+static sr_Buffer *newBlank(int w, int h) {
+  sr_Buffer *b = sr_newBuffer(w, h);
+  sr_clear(b, sr_pixel(0, 0, 0, 0));
+  return b;
+}
+
+
+static sr_Buffer *newPattern(int w, int h) {
+  sr_Buffer *b = sr_newBuffer(w, h);
+  int x, y;
+  for (y = 0; y < h; y++) {
+    for (x = 0; x < w; x++) {
+      sr_setPixel(b, sr_pixel(x * 16, y * 16, (x ^ y) * 8, 0xff), x, y);
+    }
+  }
+  return b;
+}
+
+
+static int countDiff(sr_Buffer *a, sr_Buffer *b) {
+  int x, y, n = 0;
+  for (y = 0; y < a->h; y++) {
+    for (x = 0; x < a->w; x++) {
+      n += sr_getPixel(a, x, y).word != sr_getPixel(b, x, y).word;
+    }
+  }
+  return n;
+}
+
+
+/* Draws `wrapped` and `plain` into buffers of their own with the transform
+ * and returns the number of pixels which differ */
+static int drawDiff(sr_Buffer *wrapped, sr_Buffer *plain, sr_Transform *t) {
+  sr_Buffer *a = newBlank(64, 64);
+  sr_Buffer *b = newBlank(64, 64);
+  int n;
+  sr_drawBuffer(a, wrapped, 32, 32, NULL, t);
+  sr_drawBuffer(b, plain, 32, 32, NULL, t);
+  n = countDiff(a, b);
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+  return n;
+}
+
+
+static void testWrappedDraws(void) {
+  sr_Buffer *wrapped = newPattern(16, 16);
+  sr_Buffer *plain = newPattern(16, 16);
+  sr_Buffer *a, *b;
+  sr_Transform t;
+  /* Scroll both by (5, 7), one by moving its origin and one by moving its
+   * pixels around */
+  sr_setWrap(wrapped, 1);
+  sr_scroll(wrapped, 5, 7);
+  sr_copyPixels(plain, wrapped, 0, 0, NULL, 1, 1);
+  /* Scaled and rotated draws */
+  t = sr_transform();
+  expect(drawDiff(wrapped, plain, &t) == 0);
+  t.sx = t.sy = 3;
+  expect(drawDiff(wrapped, plain, &t) == 0);
+  t.sx = 2.5;
+  t.sy = 1.7;
+  expect(drawDiff(wrapped, plain, &t) == 0);
+  t = sr_transform();
+  t.r = 0.3;
+  t.ox = t.oy = 8;
+  expect(drawDiff(wrapped, plain, &t) == 0);
+  t.sx = t.sy = 1.5;
+  expect(drawDiff(wrapped, plain, &t) == 0);
+  /* Scaled copy */
+  a = newBlank(64, 64);
+  b = newBlank(64, 64);
+  sr_copyPixels(a, wrapped, 3, 1, NULL, 3, 3);
+  sr_copyPixels(b, plain, 3, 1, NULL, 3, 3);
+  expect(countDiff(a, b) == 0);
+  /* Turning wrapping off puts the pixels in place */
+  sr_setWrap(wrapped, 0);
+  expect(countDiff(wrapped, plain) == 0);
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+  sr_destroyBuffer(wrapped);
+  sr_destroyBuffer(plain);
+}
+
+
+static void testClearDirtyClone(void) {
+  sr_Buffer *b = newPattern(16, 16);
+  sr_Buffer *clone, *plain;
+  sr_setDirtyTracking(b, 1);
+  sr_drawRect(b, sr_color(0xff, 0, 0), 2, 2, 8, 8);
+  sr_resetDirty(b);
+  clone = sr_cloneBuffer(b);
+  plain = sr_cloneBuffer(b);
+  /* Writing to `plain` gives it pixels of its own to compare against */
+  sr_setPixel(plain, sr_getPixel(b, 0, 0), 0, 0);
+  /* Clearing the buffer leaves the clone's pixels alone */
+  sr_clearDirty(b, sr_color(0, 0xff, 0));
+  expect(sr_getPixel(b, 4, 4).word == sr_color(0, 0xff, 0).word);
+  expect(countDiff(clone, plain) == 0);
+  sr_destroyBuffer(b);
+  sr_destroyBuffer(clone);
+  sr_destroyBuffer(plain);
+}
+
+
+/* Copies `src` scaled by `n` on both axes, and by `n` and `m` the other way
+ * round, both clipped part way through a pixel, and returns the number of
+ * pixels which differ where both copies wrote to. Source columns or rows
+ * which are all one color make the axis scaled by `m` not matter */
+static int copyDiff(sr_Buffer *src, int n, int m, int transpose) {
+  sr_Buffer *a = newBlank(80, 80);
+  sr_Buffer *b = newBlank(80, 80);
+  int x, y, k = 0;
+  sr_setClip(a, sr_rect(3, 2, 70, 70));
+  sr_setClip(b, sr_rect(3, 2, 70, 70));
+  sr_copyPixels(a, src, -4, -3, NULL, n, n);
+  if (transpose) {
+    sr_copyPixels(b, src, -4, -3, NULL, m, n);
+  } else {
+    sr_copyPixels(b, src, -4, -3, NULL, n, m);
+  }
+  for (y = 0; y < 80; y++) {
+    for (x = 0; x < 80; x++) {
+      if (transpose ? x >= src->w * MIN(n, m) - 4 :
+                      y >= src->h * MIN(n, m) - 3) continue;
+      k += sr_getPixel(a, x, y).word != sr_getPixel(b, x, y).word;
+    }
+  }
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+  return k;
+}
+
+
+static void testIntegerCopy(void) {
+  sr_Buffer *cols = newBlank(24, 24);
+  sr_Buffer *rows = newBlank(24, 24);
+  int x, y, n;
+  for (y = 0; y < 24; y++) {
+    for (x = 0; x < 24; x++) {
+      sr_setPixel(cols, sr_color(x * 10, 0, 0), x, y);
+      sr_setPixel(rows, sr_color(0, y * 10, 0), x, y);
+    }
+  }
+  /* A whole number scale, which has a path of its own, puts column and row
+   * boundaries where a mixed scale does */
+  for (n = 2; n <= 5; n++) {
+    expect(copyDiff(cols, n, n + 1, 0) == 0);
+    expect(copyDiff(rows, n, n + 1, 1) == 0);
+  }
+  sr_destroyBuffer(cols);
+  sr_destroyBuffer(rows);
+}
+
+
+static int parallelRuns;
+
+/* Runs the bands of a job one after another, last first, so that a band
+ * which depended on another having been drawn would show up */
+static void runReversed(void (*fn)(void*, int), void *udata, int n) {
+  parallelRuns++;
+  while (n--) {
+    fn(udata, n);
+  }
+}
+
+
+enum { OP_CLEAR, OP_RECT_MIN, OP_RECT_BELOW_MIN, OP_RECT_BLEND, OP_ROTATED,
+       OP_SCALED_LINEAR, OP_COPY, OP_COPY_SCALED, OP_COUNT };
+
+static void drawOp(sr_Buffer *b, sr_Buffer *src, sr_Buffer *big, int op) {
+  sr_Transform t = sr_transform();
+  switch (op) {
+    case OP_CLEAR:
+      sr_clear(b, sr_pixel(10, 20, 30, 200));
+      break;
+    case OP_RECT_MIN:
+      /* Exactly as large as a draw split into bands can be */
+      sr_drawRect(b, sr_color(0xff, 0, 0), 3, 5, 256, 256);
+      break;
+    case OP_RECT_BELOW_MIN:
+      sr_drawRect(b, sr_color(0xff, 0, 0), 3, 5, 256, 255);
+      break;
+    case OP_RECT_BLEND:
+      sr_setAlpha(b, 0x80);
+      sr_setBlend(b, SR_BLEND_ADD);
+      sr_drawRect(b, sr_color(0x40, 0x80, 0xc0), 17, 11, 401, 333);
+      break;
+    case OP_ROTATED:
+      t.r = 0.4;
+      t.sx = t.sy = 5;
+      t.ox = t.oy = 8;
+      sr_setAlpha(b, 0xc0);
+      sr_drawBuffer(b, src, 250, 240, NULL, &t);
+      break;
+    case OP_SCALED_LINEAR:
+      t.sx = 6.3;
+      t.sy = 5.1;
+      sr_setFilter(b, SR_FILTER_LINEAR);
+      sr_drawBuffer(b, src, -7, 13, NULL, &t);
+      break;
+    case OP_COPY:
+      sr_copyPixels(b, big, 1, 2, NULL, 1, 1);
+      break;
+    case OP_COPY_SCALED:
+      sr_copyPixels(b, src, -5, 9, NULL, 7, 7);
+      break;
+  }
+}
+
+
+static void testParallelMatchesSerial(void) {
+  sr_Buffer *src = newPattern(64, 64);
+  sr_Buffer *big = newPattern(384, 384);
+  sr_Buffer *a, *b;
+  int op, runs;
+  for (op = 0; op < OP_COUNT; op++) {
+    a = newPattern(512, 512);
+    b = newPattern(512, 512);
+    sr_setParallel(NULL, 1);
+    drawOp(a, src, big, op);
+    /* An odd number of bands puts band edges part way through the draws */
+    sr_setParallel(runReversed, 7);
+    runs = parallelRuns;
+    drawOp(b, src, big, op);
+    sr_setParallel(NULL, 1);
+    expect(!memcmp(a->pixels, b->pixels, 512 * 512 * sizeof(sr_Pixel)));
+    expect((parallelRuns > runs) == (op != OP_RECT_BELOW_MIN));
+    sr_destroyBuffer(a);
+    sr_destroyBuffer(b);
+  }
+  sr_destroyBuffer(src);
+  sr_destroyBuffer(big);
+}
+
+
+static void testBatchDraws(void) {
+  sr_Buffer *a = newPattern(32, 32);
+  sr_Buffer *b = newPattern(32, 32);
+  sr_Pixel c[3];
+  int xy[] = { 1, 1, 30, 2, -1, 5 };
+  int lines[] = { -4, 0, 40, 20, 3, 3, 3, 28, 0, 31, 31, 31 };
+  int rects[] = { 2, 2, 10, 5, 20, -3, 20, 9, 5, 5, 0, 4 };
+  int circles[] = { 16, 16, 6, 0, 0, 4, 30, 20, 9 };
+  int i;
+  c[0] = sr_pixel(0xff, 0, 0, 0x80);
+  c[1] = sr_pixel(0, 0xff, 0, 0xff);
+  c[2] = sr_pixel(0, 0, 0xff, 0x40);
+  sr_setClip(a, sr_rect(1, 1, 29, 29));
+  sr_setClip(b, sr_rect(1, 1, 29, 29));
+  /* A batch draws the same pixels as drawing each primitive on its own */
+  sr_drawPixels(a, c, xy, 3);
+  sr_drawLines(a, c, lines, 3);
+  sr_drawRects(a, c, rects, 3);
+  sr_drawCircles(a, c, circles, 3);
+  for (i = 0; i < 3; i++) {
+    sr_drawPixel(b, c[i], xy[i * 2], xy[i * 2 + 1]);
+  }
+  for (i = 0; i < 3; i++) {
+    sr_drawLine(b, c[i], lines[i * 4], lines[i * 4 + 1],
+                lines[i * 4 + 2], lines[i * 4 + 3]);
+  }
+  for (i = 0; i < 3; i++) {
+    sr_drawRect(b, c[i], rects[i * 4], rects[i * 4 + 1],
+                rects[i * 4 + 2], rects[i * 4 + 3]);
+  }
+  for (i = 0; i < 3; i++) {
+    sr_drawCircle(b, c[i], circles[i * 3], circles[i * 3 + 1],
+                  circles[i * 3 + 2]);
+  }
+  expect(countDiff(a, b) == 0);
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+}
+
+
+/* Alphas around the spans' skip and write thresholds come up more often than
+ * they would at random */
+static sr_Pixel randomPixel(void) {
+  static const int alphas[] = { 0, 1, 2, 0x80, 0xfe, 0xff };
+  int a = rand() % 8;
+  a = (a < 6) ? alphas[a] : rand() & 0xff;
+  return sr_pixel(rand() & 0xff, rand() & 0xff, rand() & 0xff, a);
+}
+
+
+static sr_Buffer *newRandom(int w, int h) {
+  sr_Buffer *b = sr_newBuffer(w, h);
+  int i;
+  for (i = 0; i < w * h; i++) {
+    b->pixels[i] = randomPixel();
+  }
+  return b;
+}
+
+
+/* Draws `n` pixels of `src` to `b` at `x` with the SIMD spans on or off. The
+ * source is drawn through a view so that it never gets a run index, which
+ * would split the span */
+static void drawSpan(sr_Buffer *b, sr_Buffer *src, int x, int n, int simd) {
+  sr_Buffer *view = sr_newBufferView(src, sr_rect(0, 0, src->w, 1));
+  sr_Rect sub = sr_rect(0, 0, n, 1);
+  sr_setSimd(simd);
+  sr_drawBuffer(b, view, x, 0, &sub, NULL);
+  sr_setSimd(1);
+  sr_destroyBuffer(view);
+}
+
+
+/* Blend span specializations picked by a draw mode, as bits of `spec` */
+#define SPEC_TINT   (1 << 0)
+#define SPEC_FADE   (1 << 1)
+#define SPEC_OPAQUE (1 << 2)
+
+/* Draws a random span of `n` pixels with and without the SIMD spans and checks
+ * the results are the same; `premul` has bit 0 set for a premultiplied source
+ * and bit 1 for a premultiplied destination */
+static void testBlendSpan(int blend, int premul, int spec, int n) {
+  sr_Buffer *src = newRandom(37, 1);
+  sr_Buffer *a = newRandom(48, 1);
+  sr_Buffer *b;
+  int x = rand() % 8;
+  int i;
+  /* The SIMD spans only blend a group of pixels themselves where none of
+   * them need the scalar spans' mixing with a translucent destination, so
+   * half the destinations are kept solid; opaque ones must be */
+  for (i = 0; i < 48 && ((n & 1) || (spec & SPEC_OPAQUE)); i++) {
+    a->pixels[i].rgba.a = (spec & SPEC_OPAQUE) ? 0xff : 0xfe | (rand() & 1);
+  }
+  if (spec & SPEC_OPAQUE) {
+    a->flags |= SR_BUFFER_OPAQUE;
+  }
+  sr_setPremultiplied(src, premul & 1);
+  sr_setPremultiplied(a, premul & 2);
+  sr_setBlend(a, blend);
+  if (spec & SPEC_TINT) {
+    sr_setColor(a, sr_pixel(rand() & 0xff, rand() & 0xff, rand() & 0xff, 0));
+  }
+  if (spec & SPEC_FADE) {
+    sr_setAlpha(a, rand() % 0xff);
+  }
+  b = sr_cloneBuffer(a);
+  drawSpan(a, src, x, n, 0);
+  drawSpan(b, src, x, n, 1);
+  expect(!memcmp(a->pixels, b->pixels, 48 * sizeof(sr_Pixel)));
+  sr_destroyBuffer(src);
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+}
+
+
+static void testBlendSpans(void) {
+  int blend, premul, spec, n;
+  srand(1);
+  for (blend = SR_BLEND_ALPHA; blend <= SR_BLEND_DIFFERENCE; blend++) {
+    for (premul = 0; premul < 4; premul++) {
+      for (spec = 0; spec < 8; spec++) {
+        for (n = 1; n <= 37; n++) {
+          testBlendSpan(blend, premul, spec, n);
+        }
+      }
+    }
+  }
+}
+
+/* Draws a line to `big` and, moved by (-ox, -oy), to `small`, then checks
+ * that the pixels inside `small`'s clip rect match and none outside it were
+ * drawn */
+static void compareLine(sr_Buffer *big, sr_Buffer *small, int ox, int oy,
+                        int x0, int y0, int x1, int y1) {
+  sr_Pixel c = sr_pixel(0xff, 0xff, 0xff, 0xff);
+  sr_Rect r = small->clip;
+  int x, y, n = 0;
+  sr_clear(big, sr_pixel(0, 0, 0, 0));
+  sr_clear(small, sr_pixel(0, 0, 0, 0));
+  sr_drawLine(big, c, x0, y0, x1, y1);
+  sr_drawLine(small, c, x0 - ox, y0 - oy, x1 - ox, y1 - oy);
+  for (y = 0; y < small->h; y++) {
+    for (x = 0; x < small->w; x++) {
+      if (x >= r.x && x < r.x + r.w && y >= r.y && y < r.y + r.h) {
+        n += sr_getPixel(small, x, y).word !=
+             sr_getPixel(big, x + ox, y + oy).word;
+      } else {
+        n += sr_getPixel(small, x, y).word != 0;
+      }
+    }
+  }
+  expect(n == 0);
+}
+
+
+static void testClippedLines(void) {
+  sr_Buffer *big = newBlank(1024, 1024);
+  sr_Buffer *small = newBlank(64, 64);
+  sr_Rect r;
+  int i, ox = 480, oy = 500;
+  srand(2);
+  for (i = 0; i < 1000; i++) {
+    /* Alternate between the whole of the small buffer and a clip rect */
+    if (i & 1) {
+      sr_setClip(small, sr_rect(5, 7, 50, 40));
+    } else {
+      sr_setClip(small, sr_rect(0, 0, 64, 64));
+    }
+    r = small->clip;
+    r.x += ox;
+    r.y += oy;
+    if (i & 2) {
+      /* Endpoints up to hundreds of pixels off the small buffer */
+      compareLine(big, small, ox, oy, rand() % 1024, rand() % 1024,
+                  rand() % 1024, rand() % 1024);
+    } else {
+      /* Endpoints on the clip rect's edges */
+      compareLine(big, small, ox, oy,
+                  r.x + (rand() & 1) * (r.w - 1), r.y + rand() % r.h,
+                  r.x + rand() % r.w, r.y + (rand() & 1) * (r.h - 1));
+    }
+  }
+  sr_destroyBuffer(big);
+  sr_destroyBuffer(small);
+}
+
+
+static void testPolylineVertices(void) {
+  sr_Buffer *b = newBlank(48, 48);
+  int points[] = { 2, 2, 20, 5, 25, 30, 10, 40, 3, 20, -10, 30, 3, 44 };
+  int i, x, y, n = 0;
+  sr_setBlend(b, SR_BLEND_ADD);
+  sr_drawPolyline(b, sr_pixel(0x10, 0x10, 0x10, 0xff), points, 7);
+  /* Every vertex is drawn, and nothing is drawn twice */
+  for (i = 0; i < 7; i++) {
+    x = points[i * 2];
+    y = points[i * 2 + 1];
+    if (x >= 0) {
+      expect(sr_getPixel(b, x, y).rgba.r == 0x10);
+    }
+  }
+  for (y = 0; y < b->h; y++) {
+    for (x = 0; x < b->w; x++) {
+      n += sr_getPixel(b, x, y).rgba.r > 0x10;
+    }
+  }
+  expect(n == 0);
+  sr_destroyBuffer(b);
+}
+
+
+static void testViewFormat(void) {
+  sr_Buffer *parent = sr_newBuffer(16, 16);
+  sr_Buffer *view = sr_newBufferView(parent, sr_rect(2, 3, 8, 8));
+  sr_Buffer *a = newBlank(8, 8);
+  sr_Buffer *b = newBlank(8, 8);
+  sr_Rect sub = sr_rect(2, 3, 8, 8);
+  int x, y, n = 0;
+  for (y = 0; y < 16; y++) {
+    for (x = 0; x < 16; x++) {
+      sr_setPixel(parent, sr_pixel(x * 16, y * 16, 0xff, x * y), x, y);
+    }
+  }
+  /* A view made before its parent is premultiplied reads and draws its
+   * pixels as premultiplied ones */
+  sr_setPremultiplied(parent, 1);
+  expect(sr_isPremultiplied(view));
+  for (y = 0; y < 8; y++) {
+    for (x = 0; x < 8; x++) {
+      n += sr_getPixel(view, x, y).word !=
+           sr_getPixel(parent, x + 2, y + 3).word;
+    }
+  }
+  expect(n == 0);
+  sr_drawBuffer(a, view, 0, 0, NULL, NULL);
+  sr_drawBuffer(b, parent, 0, 0, &sub, NULL);
+  expect(countDiff(a, b) == 0);
+  sr_destroyBuffer(view);
+  sr_destroyBuffer(parent);
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+}
+
+
+/* Draws the grid of tiles one at a time as sr_drawTiles() should */
+static void drawTilesSlow(sr_Buffer *b, sr_Buffer *src, int x, int y,
+                          int tw, int th, int *tiles, int w, int h) {
+  int i, tile, columns = src->w / tw;
+  sr_Rect r;
+  for (i = 0; i < w * h; i++) {
+    tile = tiles[i] - 1;
+    if (tile < 0) continue;
+    r = sr_rect((tile % columns) * tw, (tile / columns) * th, tw, th);
+    sr_drawBuffer(b, src, x + (i % w) * tw, y + (i / w) * th, &r, NULL);
+  }
+}
+
+
+static void testDrawTiles(void) {
+  sr_Buffer *tileset = newPattern(32, 16);
+  sr_Buffer *a = newBlank(40, 40);
+  sr_Buffer *b = newBlank(40, 40);
+  int tiles[] = { 1, 2, 0, 4, 8, 3, 3, 0, 5, 6, 7, 1, 0, 2, 8, 4 };
+  int i, x, y;
+  /* Tile 2 is partly translucent, tile 3 empty */
+  for (y = 0; y < 8; y++) {
+    for (x = 8; x < 24; x++) {
+      sr_setPixel(tileset, sr_pixel(x * 16, y * 16, 0, (x < 12) * 0x40),
+                  x, y);
+    }
+  }
+  sr_setClip(a, sr_rect(3, 2, 30, 33));
+  sr_setClip(b, sr_rect(3, 2, 30, 33));
+  /* The second and later draws use the tileset's run index, which must be
+   * rebuilt once the tileset changes */
+  for (i = 0; i < 3; i++) {
+    if (i == 2) {
+      sr_drawRect(tileset, sr_pixel(0xff, 0, 0, 0x80), 0, 0, 32, 3);
+    }
+    sr_drawTiles(a, tileset, -5, 4, 8, 8, tiles, 4, 4);
+    drawTilesSlow(b, tileset, -5, 4, 8, 8, tiles, 4, 4);
+    expect(countDiff(a, b) == 0);
+  }
+  sr_destroyBuffer(tileset);
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+}
+
+
+static void testPrepareWrite(void) {
+  sr_Buffer *a = newPattern(16, 16);
+  sr_Buffer *b = sr_cloneBuffer(a);
+  sr_Buffer *view;
+  sr_Rect r;
+  /* Marking a rect dirty is only bookkeeping, it doesn't copy shared pixels */
+  sr_setDirtyTracking(b, 1);
+  sr_resetDirty(b);
+  sr_markDirty(b, sr_rect(1, 2, 3, 4));
+  expect(b->pixels == a->pixels);
+  expect(b->dirty->count == 1);
+  sr_prepareWrite(b, sr_rect(0, 0, 16, 16));
+  expect(b->pixels != a->pixels);
+  sr_destroyBuffer(b);
+  /* Writes through a view mark the rect dirty in its parent */
+  sr_setDirtyTracking(a, 1);
+  sr_resetDirty(a);
+  view = sr_newBufferView(a, sr_rect(4, 5, 8, 8));
+  sr_drawRect(view, sr_pixel(0xff, 0, 0, 0xff), 1, 1, 2, 3);
+  expect(a->dirty->count == 1);
+  r = a->dirty->rects[0];
+  expect(r.x == 5 && r.y == 6 && r.w == 2 && r.h == 3);
+  sr_destroyBuffer(view);
+  sr_destroyBuffer(a);
+}
+
+
+static void testA8Writes(void) {
+  sr_Buffer *a = sr_newBufferA8(16, 16);
+  sr_Buffer *b = sr_newBuffer(16, 16);
+  unsigned char data[16 * 16];
+  int i, n = 0;
+  srand(3);
+  for (i = 0; i < 16 * 16; i++) {
+    data[i] = rand() & 0xff;
+    b->pixels[i] = sr_pixel(0xff, 0xff, 0xff, data[i]);
+  }
+  sr_loadPixels8(a, data, NULL);
+  /* Alpha-only writes keep the buffer 8-bit and change its coverage as they
+   * would the alpha of a 32-bit buffer */
+  for (i = 0; i < 2; i++) {
+    sr_setClip(i ? a : b, sr_rect(1, 2, 12, 11));
+    sr_setAlpha(i ? a : b, 0x90);
+    sr_clear(i ? a : b, sr_pixel(0xff, 0xff, 0xff, 0x30));
+    sr_drawRect(i ? a : b, sr_pixel(0xff, 0xff, 0xff, 0xc0), 4, -3, 20, 9);
+    sr_drawRect(i ? a : b, sr_pixel(0xff, 0xff, 0xff, 0xff), 2, 8, 3, 3);
+    sr_setAlpha(i ? a : b, 0xff);
+    sr_drawRect(i ? a : b, sr_pixel(0xff, 0xff, 0xff, 0xff), 9, 9, 2, 2);
+    sr_setPixel(i ? a : b, sr_pixel(0xff, 0xff, 0xff, 0x12), 0, 0);
+  }
+  expect(a->flags & SR_BUFFER_A8);
+  for (i = 0; i < 16 * 16; i++) {
+    n += sr_getPixel(a, i % 16, i / 16).rgba.a !=
+         sr_getPixel(b, i % 16, i / 16).rgba.a;
+  }
+  expect(n == 0);
+  /* Other writes convert it to 32-bit */
+  sr_drawLine(a, sr_pixel(0xff, 0, 0, 0xff), 0, 0, 15, 15);
+  expect(!(a->flags & SR_BUFFER_A8));
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+}
+
+
+static void testDrawParticles(void) {
+  sr_Buffer *src = newPattern(6, 5);
+  sr_Buffer *a = newBlank(32, 32);
+  sr_Buffer *b = newBlank(32, 32);
+  float px[] = { 4, 20.5f, 11, 30 };
+  float py[] = { 3, 8, 19.25f, 30 };
+  float scale[] = { 1, 2, 0.5f, 1.5f };
+  float alpha[] = { 1, 0.5f, 0.25f, 2 };
+  sr_Transform t = sr_transform();
+  int i;
+  sr_setAlpha(a, 0x80);
+  sr_drawParticles(a, src, 1, 2, px, py, scale, alpha, 4);
+  /* The buffer's alpha is left as it was */
+  expect(a->mode.alpha == 0x80);
+  t.ox = src->w / 2;
+  t.oy = src->h / 2;
+  for (i = 0; i < 4; i++) {
+    sr_setAlpha(b, MIN(0x80 * alpha[i], 0xff));
+    t.sx = t.sy = scale[i];
+    sr_drawBuffer(b, src, 1 + px[i], 2 + py[i], NULL, &t);
+  }
+  expect(countDiff(a, b) == 0);
+  sr_destroyBuffer(src);
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+}
+
+
+static void testFloodFill(void) {
+  sr_Buffer *b = newBlank(8, 8);
+  sr_Pixel wall = sr_pixel(0xff, 0xff, 0xff, 0xff);
+  sr_Pixel c = sr_pixel(0xff, 0, 0, 0xff);
+  sr_Pixel o = sr_pixel(0x10, 0x20, 0x30, 0xff);
+  int i;
+  /* Cells touching only at corners, and one a little off the fill's color */
+  for (i = 0; i < 2; i++) {
+    sr_clear(b, wall);
+    sr_setPixel(b, o, 1, 1);
+    sr_setPixel(b, o, 2, 2);
+    sr_setPixel(b, o, 3, 3);
+    sr_setPixel(b, sr_pixel(0x13, 0x20, 0x30, 0xff), 3, 4);
+    expect(sr_floodFill(b, c, 1, 1, 0, i));
+    /* Fills are 4-connected unless diagonal */
+    expect(sr_getPixel(b, 1, 1).word == c.word);
+    expect(sr_getPixel(b, 2, 2).word == (i ? c : o).word);
+    expect(sr_getPixel(b, 3, 3).word == (i ? c : o).word);
+    expect(sr_getPixel(b, 3, 4).word != c.word);
+    expect(sr_getPixel(b, 0, 0).word == wall.word);
+  }
+  /* Tolerance is the largest difference allowed in any channel */
+  sr_clear(b, wall);
+  sr_setPixel(b, o, 3, 3);
+  sr_setPixel(b, sr_pixel(0x13, 0x20, 0x30, 0xff), 3, 4);
+  sr_setPixel(b, sr_pixel(0x10, 0x24, 0x30, 0xff), 3, 5);
+  expect(sr_floodFill(b, c, 3, 3, 3, 0));
+  expect(sr_getPixel(b, 3, 4).word == c.word);
+  expect(sr_getPixel(b, 3, 5).word != c.word);
+  sr_destroyBuffer(b);
+}
+
+
+/* Draws a mix of commands, changing the draw mode and clip between them */
+static void drawCommands(sr_Buffer *b, sr_Buffer *src) {
+  sr_Transform t = sr_transform();
+  sr_Rect sub = sr_rect(3, 2, 40, 30);
+  sr_clear(b, sr_pixel(0x20, 0x40, 0x60, 0xff));
+  sr_drawRect(b, sr_pixel(0xff, 0, 0, 0x80), 10, 20, 150, 90);
+  sr_setBlend(b, SR_BLEND_ADD);
+  sr_drawBuffer(b, src, 50, 60, NULL, NULL);
+  sr_setClip(b, sr_rect(30, 40, 120, 130));
+  sr_setAlpha(b, 0x60);
+  t.r = 0.7f;
+  t.sx = 1.5f;
+  t.sy = 2;
+  sr_drawBuffer(b, src, 100, 100, &sub, &t);
+  sr_setBlend(b, SR_BLEND_MULTIPLY);
+  sr_setColor(b, sr_pixel(0xff, 0x80, 0x40, 0xff));
+  sr_drawBuffer(b, src, -20, 90, NULL, NULL);
+  sr_reset(b);
+  sr_copyPixels(b, src, 150, 130, &sub, 2, 3);
+  sr_drawRect(b, sr_pixel(0, 0xff, 0, 0x40), 0, 0, 200, 200);
+}
+
+
+static void testCommandLists(void) {
+  sr_Buffer *src = newPattern(64, 48);
+  sr_Buffer *a = newBlank(200, 200);
+  sr_Buffer *b = newBlank(200, 200);
+  /* A recorded list draws the same pixels as drawing immediately */
+  sr_beginCommands(a);
+  expect(a->commands != NULL);
+  drawCommands(a, src);
+  sr_endCommands(a);
+  drawCommands(b, src);
+  expect(!memcmp(a->pixels, b->pixels, 200 * 200 * sizeof(sr_Pixel)));
+  sr_destroyBuffer(src);
+  sr_destroyBuffer(a);
+  sr_destroyBuffer(b);
+}
+
+
+int main(void) {
+  testWrappedDraws();
+  testClearDirtyClone();
+  testIntegerCopy();
+  testBatchDraws();
+  testParallelMatchesSerial();
+  testBlendSpans();
+  testClippedLines();
+  testPolylineVertices();
+  testViewFormat();
+  testDrawTiles();
+  testPrepareWrite();
+  testA8Writes();
+  testDrawParticles();
+  testFloodFill();
+  testCommandLists();
+  if (failures) {
+    fprintf(stderr, "%d failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("all passed\n");
+  return EXIT_SUCCESS;
+}